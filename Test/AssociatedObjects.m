@@ -0,0 +1,66 @@
+#include "Test.h"
+#include <time.h>
+#include <stdio.h>
+
+/**
+ * More keys than fit in a single reference list, as objects with many
+ * category-defined properties have.
+ */
+#define KEYS 100
+
+static char keys[KEYS];
+
+int main(void)
+{
+	id obj = [Test new];
+	for (int i=0 ; i<KEYS ; i++)
+	{
+		objc_setAssociatedObject(obj, &keys[i], (id)&keys[i],
+				OBJC_ASSOCIATION_ASSIGN);
+		for (int j=0 ; j<=i ; j++)
+		{
+			assert((id)&keys[j] == objc_getAssociatedObject(obj, &keys[j]));
+		}
+	}
+	// Replacing an existing value must not add another reference.
+	for (int i=0 ; i<KEYS ; i++)
+	{
+		objc_setAssociatedObject(obj, &keys[i], (id)&keys[KEYS - i - 1],
+				OBJC_ASSOCIATION_ASSIGN);
+	}
+	for (int i=0 ; i<KEYS ; i++)
+	{
+		assert((id)&keys[KEYS - i - 1] == objc_getAssociatedObject(obj, &keys[i]));
+	}
+	objc_removeAssociatedObjects(obj);
+	for (int i=0 ; i<KEYS ; i++)
+	{
+		assert(nil == objc_getAssociatedObject(obj, &keys[i]));
+	}
+	objc_setAssociatedObject(obj, &keys[1], (id)&keys[1], OBJC_ASSOCIATION_ASSIGN);
+	assert((id)&keys[1] == objc_getAssociatedObject(obj, &keys[1]));
+	assert(nil == objc_getAssociatedObject(obj, &keys[0]));
+#ifdef BENCHMARK
+	for (int i=0 ; i<KEYS ; i++)
+	{
+		objc_setAssociatedObject(obj, &keys[i], (id)&keys[i],
+				OBJC_ASSOCIATION_ASSIGN);
+	}
+	struct timespec t1, t2;
+	int iterations = 100000;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	for (int j=0 ; j<iterations ; j++)
+	{
+		for (int i=0 ; i<KEYS ; i++)
+		{
+			objc_getAssociatedObject(obj, &keys[i]);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+	double seconds = (t2.tv_sec - t1.tv_sec) +
+		((double)t2.tv_nsec - (double)t1.tv_nsec) / 1000000000.0;
+	printf("%d keys: %f nanoseconds per lookup. \n", KEYS,
+		seconds * 1000000000.0 / ((double)iterations * KEYS));
+#endif
+	return 0;
+}
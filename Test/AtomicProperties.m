@@ -0,0 +1,173 @@
+#include "Test.h"
+#include "../objc/objc-arc.h"
+#include <time.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#define MAX_THREADS 16
+
+void objc_copyPropertyStruct(void *dest, void *src, ptrdiff_t size,
+                             BOOL atomic, BOOL strong);
+void objc_getPropertyStruct(void *dest, void *src, ptrdiff_t size,
+                            BOOL atomic, BOOL strong);
+void objc_setPropertyStruct(void *dest, void *src, ptrdiff_t size,
+                            BOOL atomic, BOOL strong);
+
+@interface Holder : Test
+{
+	id value;
+}
+@property (atomic, retain) id value;
+@end
+@implementation Holder
+@synthesize value;
+@end
+
+struct pair
+{
+	long a, b;
+};
+
+static Holder *holder;
+static id values[2];
+static struct pair sharedPair;
+
+/**
+ * Repeatedly writes the shared structure, with both fields always equal.
+ */
+static void *writePair(void *arg)
+{
+	for (long i=0 ; i<100000 ; i++)
+	{
+		struct pair p = { i, i };
+		objc_setPropertyStruct(&sharedPair, &p, sizeof(p), YES, NO);
+	}
+	return NULL;
+}
+
+/**
+ * Reads the shared structure while it is being written, checking that no read
+ * sees half of a write.
+ */
+static void *readPair(void *arg)
+{
+	for (int i=0 ; i<100000 ; i++)
+	{
+		struct pair p;
+		objc_getPropertyStruct(&p, &sharedPair, sizeof(p), YES, NO);
+		assert(p.a == p.b);
+	}
+	return NULL;
+}
+
+/**
+ * Reads the property and sometimes replaces it, so that every thread contends
+ * for the same lock.
+ */
+static void *accessProperty(void *arg)
+{
+	int iterations = (int)(intptr_t)arg;
+	void *pool = objc_autoreleasePoolPush();
+	for (int i=0 ; i<iterations ; i++)
+	{
+		if (0 == (i % 1024))
+		{
+			objc_autoreleasePoolPop(pool);
+			pool = objc_autoreleasePoolPush();
+		}
+		id v = [holder value];
+		assert((v == values[0]) || (v == values[1]));
+		if (0 == (i % 4))
+		{
+			[holder setValue: values[(i / 4) % 2]];
+		}
+	}
+	objc_autoreleasePoolPop(pool);
+	return NULL;
+}
+
+/**
+ * Replaces the property with new objects, so that the old value is
+ * deallocated while other threads may be reading it.
+ */
+static void *replaceProperty(void *arg)
+{
+	void *pool = objc_autoreleasePoolPush();
+	for (int i=0 ; i<100000 ; i++)
+	{
+		if (0 == (i % 1024))
+		{
+			objc_autoreleasePoolPop(pool);
+			pool = objc_autoreleasePoolPush();
+		}
+		id obj = [Test new];
+		[holder setValue: obj];
+		objc_release(obj);
+		assert(nil != [holder value]);
+	}
+	objc_autoreleasePoolPop(pool);
+	return NULL;
+}
+
+static void runThreads(int count, int iterations)
+{
+	pthread_t threads[MAX_THREADS];
+	for (int i=0 ; i<count ; i++)
+	{
+		pthread_create(&threads[i], NULL, accessProperty,
+				(void*)(intptr_t)iterations);
+	}
+	for (int i=0 ; i<count ; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+}
+
+int main(void)
+{
+	values[0] = [Test new];
+	values[1] = [Test new];
+	holder = [Holder new];
+	[holder setValue: values[0]];
+	runThreads(8, 100000);
+	pthread_t threads[4];
+	for (int i=0 ; i<4 ; i++)
+	{
+		pthread_create(&threads[i], NULL, replaceProperty, NULL);
+	}
+	for (int i=0 ; i<4 ; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+	[holder setValue: values[0]];
+	pthread_create(&threads[0], NULL, writePair, NULL);
+	for (int i=1 ; i<4 ; i++)
+	{
+		pthread_create(&threads[i], NULL, readPair, NULL);
+	}
+	for (int i=0 ; i<4 ; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+	// Copying between adjacent structures takes two locks that may be the
+	// same one.
+	struct pair pairs[2] = { { 1, 2 }, { 3, 4 } };
+	objc_copyPropertyStruct(&pairs[0], &pairs[1], sizeof(struct pair), YES, NO);
+	assert((pairs[0].a == 3) && (pairs[0].b == 4));
+#ifdef BENCHMARK
+	for (int threads=1 ; threads<=MAX_THREADS ; threads*=2)
+	{
+		struct timespec t1, t2;
+		int iterations = 1000000;
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		runThreads(threads, iterations);
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+		double seconds = (t2.tv_sec - t1.tv_sec) +
+			((double)t2.tv_nsec - (double)t1.tv_nsec) / 1000000000.0;
+		printf("%d threads: %f contended atomic property accesses per second. \n",
+			threads, ((double)threads * iterations) / seconds);
+	}
+#endif
+	return 0;
+}
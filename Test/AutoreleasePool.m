@@ -0,0 +1,95 @@
+#include "Test.h"
+#include "../objc/objc-arc.h"
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * Enough objects to fill several pool pages.
+ */
+#define OBJECTS 2000
+
+/**
+ * Pushes a pool, autoreleases count objects into it, and pops it again.
+ */
+static void autoreleaseObjects(id obj, int count)
+{
+	void *pool = objc_autoreleasePoolPush();
+	unsigned long before = objc_arc_autorelease_count_np();
+	for (int i=0 ; i<count ; i++)
+	{
+		objc_autorelease(objc_retain(obj));
+	}
+	assert(objc_arc_autorelease_count_np() == before + count);
+	objc_autoreleasePoolPop(pool);
+	assert(objc_arc_autorelease_count_np() == before);
+}
+
+int main(void)
+{
+	id obj = [Test new];
+	// Nested pools that span several pages, so that pages are returned to the
+	// cache and reused while outer pools still hold objects.
+	void *outer = objc_autoreleasePoolPush();
+	for (int i=0 ; i<100 ; i++)
+	{
+		objc_autorelease(objc_retain(obj));
+		autoreleaseObjects(obj, OBJECTS);
+		autoreleaseObjects(obj, i);
+	}
+	assert(objc_arc_autorelease_count_np() == 100);
+	assert(objc_arc_autorelease_count_for_object_np(obj) == 100);
+	objc_autoreleasePoolPop(outer);
+	assert(objc_arc_autorelease_count_np() == 0);
+#ifdef BENCHMARK
+	for (int objects=1 ; objects<=4096 ; objects*=4)
+	{
+		struct timespec t1, t2;
+		int iterations = 4000000 / objects;
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		for (int i=0 ; i<iterations ; i++)
+		{
+			void *pool = objc_autoreleasePoolPush();
+			for (int j=0 ; j<objects ; j++)
+			{
+				objc_autorelease(objc_retain(obj));
+			}
+			objc_autoreleasePoolPop(pool);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+		double seconds = (t2.tv_sec - t1.tv_sec) +
+			((double)t2.tv_nsec - (double)t1.tv_nsec) / 1000000000.0;
+		printf("%d objects: %f push / autorelease / pop cycles per second. \n",
+			objects, iterations / seconds);
+	}
+	{
+		// Drain a single large pool, in which every object has the same class.
+		int objects = 1000000;
+		id *many = malloc(objects * sizeof(id));
+		for (int i=0 ; i<objects ; i++)
+		{
+			many[i] = [Test new];
+		}
+		void *pool = objc_autoreleasePoolPush();
+		for (int i=0 ; i<objects ; i++)
+		{
+			objc_autorelease(objc_retain(many[i]));
+		}
+		struct timespec t1, t2;
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		objc_autoreleasePoolPop(pool);
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+		double seconds = (t2.tv_sec - t1.tv_sec) +
+			((double)t2.tv_nsec - (double)t1.tv_nsec) / 1000000000.0;
+		printf("%d objects: %f nanoseconds per object to drain. \n",
+			objects, seconds * 1000000000.0 / objects);
+		for (int i=0 ; i<objects ; i++)
+		{
+			objc_release(many[i]);
+		}
+		free(many);
+	}
+#endif
+	objc_release(obj);
+	return 0;
+}
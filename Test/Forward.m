@@ -70,4 +70,11 @@ int main(void)
 	[proxy foo: 42];
 	[proxy dealloc];
 	assert(forwardingTargetCalled == YES);
+	struct objc_dispatch_stats_np stats;
+	if (objc_getDispatchStats_np(&stats))
+	{
+		assert(stats.proxy_lookups >= 1);
+		assert(stats.forwards >= 1);
+		assert(stats.slow_lookups >= stats.forwards);
+	}
 }
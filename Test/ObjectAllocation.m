@@ -0,0 +1,132 @@
+#include "Test.h"
+#include <time.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#define OBJECTS 10000
+#define THREADS 4
+
+@interface Sized : Test
+{
+@public
+	char bytes[40];
+}
+@end
+@implementation Sized @end
+
+static id objects[THREADS][OBJECTS];
+
+/**
+ * Checks that every instance variable of a new object is zeroed, then fills
+ * them, so that reusing the memory without clearing it would be noticed.
+ */
+static id newObject(int extraBytes)
+{
+	Sized *obj = class_createInstance([Sized class], extraBytes);
+	char *bytes = object_getIndexedIvars(obj);
+	for (int i=0 ; i<sizeof(obj->bytes) ; i++)
+	{
+		assert(0 == obj->bytes[i]);
+	}
+	for (int i=0 ; i<extraBytes ; i++)
+	{
+		assert(0 == bytes[i]);
+	}
+	memset(obj->bytes, 0xff, sizeof(obj->bytes));
+	memset(bytes, 0xff, extraBytes);
+	return obj;
+}
+
+static void *allocateObjects(void *arg)
+{
+	id *objs = arg;
+	for (int i=0 ; i<OBJECTS ; i++)
+	{
+		objs[i] = newObject(i % 600);
+	}
+	return NULL;
+}
+
+/**
+ * Frees objects allocated by another thread, then allocates and frees some of
+ * its own, which may reuse the same memory.
+ */
+static void *freeObjects(void *arg)
+{
+	id *objs = arg;
+	for (int i=0 ; i<OBJECTS ; i++)
+	{
+		object_dispose(objs[i]);
+	}
+	for (int i=0 ; i<OBJECTS ; i++)
+	{
+		object_dispose(newObject(i % 600));
+	}
+	return NULL;
+}
+
+static void runThreads(void *(*fn)(void*))
+{
+	pthread_t threads[THREADS];
+	for (int i=0 ; i<THREADS ; i++)
+	{
+		pthread_create(&threads[i], NULL, fn, objects[i]);
+	}
+	for (int i=0 ; i<THREADS ; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+}
+
+int main(void)
+{
+	struct objc_allocation_stats_np before, after;
+	BOOL haveStats = objc_getAllocationStats_np(&before);
+	for (int i=0 ; i<3 ; i++)
+	{
+		runThreads(allocateObjects);
+		runThreads(freeObjects);
+	}
+	assert(haveStats == objc_getAllocationStats_np(&after));
+	if (haveStats)
+	{
+		assert(after.slab_allocations > before.slab_allocations);
+		assert(after.large_allocations > before.large_allocations);
+		assert(after.bytes_in_use == before.bytes_in_use);
+	}
+	else
+	{
+		assert(0 == after.slab_allocations);
+	}
+#ifdef BENCHMARK
+	{
+		id *many = objects[0];
+		int iterations = 1000;
+		struct timespec t1, t2;
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		for (int j=0 ; j<iterations ; j++)
+		{
+			for (int i=0 ; i<OBJECTS ; i++)
+			{
+				many[i] = class_createInstance([Sized class], 0);
+			}
+			for (int i=0 ; i<OBJECTS ; i++)
+			{
+				object_dispose(many[i]);
+			}
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+		double seconds = (t2.tv_sec - t1.tv_sec) +
+			((double)t2.tv_nsec - (double)t1.tv_nsec) / 1000000000.0;
+		printf("%f nanoseconds per object allocated and freed. \n",
+			seconds * 1000000000.0 / ((double)iterations * OBJECTS));
+		if (objc_getAllocationStats_np(&after))
+		{
+			printf("%llu bytes of slabs reserved. \n",
+				(unsigned long long)after.bytes_mapped);
+		}
+	}
+#endif
+	return 0;
+}
@@ -0,0 +1,86 @@
+#include "Test.h"
+#include "../objc/objc-arc.h"
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define OBJECTS 1000
+
+static int deallocCount;
+
+@interface Counted : Test @end
+@implementation Counted
+- (void)dealloc
+{
+	deallocCount++;
+	object_dispose(self);
+}
+@end
+
+@interface OtherCounted : Counted @end
+@implementation OtherCounted @end
+
+int main(void)
+{
+	id objects[OBJECTS];
+	// Runs of objects of each class, separated by nil.
+	for (int i=0 ; i<OBJECTS ; i++)
+	{
+		if (0 == (i % 100))
+		{
+			objects[i] = nil;
+		}
+		else if ((i / 50) % 2)
+		{
+			objects[i] = [OtherCounted new];
+		}
+		else
+		{
+			objects[i] = [Counted new];
+		}
+	}
+	objc_retainArray_np(objects, OBJECTS);
+	for (int i=0 ; i<OBJECTS ; i++)
+	{
+		objc_release(objects[i]);
+	}
+	assert(0 == deallocCount);
+	objc_releaseArray_np(objects, OBJECTS);
+	assert(OBJECTS - (OBJECTS / 100) == deallocCount);
+#ifdef BENCHMARK
+	{
+		int count = 1000000;
+		id *many = malloc(count * sizeof(id));
+		for (int i=0 ; i<count ; i++)
+		{
+			many[i] = [Test new];
+		}
+		struct timespec t1, t2;
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		for (int i=0 ; i<count ; i++)
+		{
+			objc_retain(many[i]);
+		}
+		for (int i=0 ; i<count ; i++)
+		{
+			objc_release(many[i]);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+		double seconds = (t2.tv_sec - t1.tv_sec) +
+			((double)t2.tv_nsec - (double)t1.tv_nsec) / 1000000000.0;
+		printf("%f nanoseconds per object to retain and release singly. \n",
+			seconds * 1000000000.0 / count);
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		objc_retainArray_np(many, count);
+		objc_releaseArray_np(many, count);
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+		seconds = (t2.tv_sec - t1.tv_sec) +
+			((double)t2.tv_nsec - (double)t1.tv_nsec) / 1000000000.0;
+		printf("%f nanoseconds per object to retain and release as an array. \n",
+			seconds * 1000000000.0 / count);
+		objc_releaseArray_np(many, count);
+		free(many);
+	}
+#endif
+	return 0;
+}
@@ -0,0 +1,81 @@
+#include <time.h>
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include "../objc/runtime.h"
+
+/**
+ * Words used to build selector names that look like the ones in a typical
+ * GNUstep application, for example initWithFrame:styleMask:backing:defer:.
+ */
+static const char *verbs[] = { "init", "set", "get", "is", "add", "remove",
+	"insert", "replace", "draw", "perform", "observe", "make", "copy",
+	"will", "did", "should", "mouse", "key", "scroll", "validate" };
+static const char *nouns[] = { "Object", "Frame", "Title", "Delegate",
+	"Value", "String", "Attributes", "Subview", "Window", "Selection",
+	"Range", "Bounds", "Color", "Font", "Menu", "Item", "Target", "Action",
+	"Notification", "KeyPath", "Data", "Index", "Row", "Column", "Cell" };
+static const char *suffixes[] = { "", ":", "With:", "ForKey:", ":forKey:",
+	":atIndex:", "InRect:withAttributes:", ":options:context:",
+	"WithFrame:styleMask:backing:defer:", ":display:animate:" };
+
+#define VERBS (sizeof(verbs) / sizeof(*verbs))
+#define NOUNS (sizeof(nouns) / sizeof(*nouns))
+#define SUFFIXES (sizeof(suffixes) / sizeof(*suffixes))
+#define SELECTOR_COUNT (VERBS * NOUNS * SUFFIXES)
+
+static char names[SELECTOR_COUNT][96];
+static SEL selectors[SELECTOR_COUNT];
+
+int main(void)
+{
+	int n = 0;
+	for (int v=0 ; v<VERBS ; v++)
+	{
+		for (int o=0 ; o<NOUNS ; o++)
+		{
+			for (int s=0 ; s<SUFFIXES ; s++)
+			{
+				snprintf(names[n], sizeof(names[n]), "%s%s%s", verbs[v],
+						nouns[o], suffixes[s]);
+				selectors[n] = sel_registerName(names[n]);
+				n++;
+			}
+		}
+	}
+	// The same name must find the same selector, whatever its alignment and
+	// whatever follows the terminator.
+	char buffer[128];
+	for (int i=0 ; i<SELECTOR_COUNT ; i+=7)
+	{
+		size_t length = strlen(names[i]);
+		for (int offset=0 ; offset<16 ; offset++)
+		{
+			memset(buffer, 'x', sizeof(buffer));
+			memcpy(buffer + offset, names[i], length + 1);
+			assert(selectors[i] == sel_registerName(buffer + offset));
+			assert(strcmp(names[i], sel_getName(selectors[i])) == 0);
+		}
+	}
+	// Names that differ only after a word boundary must be distinct.
+	assert(sel_registerName("abcdefgh") != sel_registerName("abcdefg"));
+	assert(sel_registerName("abcdefghi") != sel_registerName("abcdefgh"));
+#ifdef BENCHMARK
+	struct timespec t1, t2;
+	int iterations = 100;
+	clock_gettime(CLOCK_MONOTONIC, &t1);
+	for (int j=0 ; j<iterations ; j++)
+	{
+		for (int i=0 ; i<SELECTOR_COUNT ; i++)
+		{
+			sel_registerName(names[i]);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &t2);
+	double seconds = (t2.tv_sec - t1.tv_sec) +
+		((double)t2.tv_nsec - (double)t1.tv_nsec) / 1000000000.0;
+	printf("%d selectors: %f nanoseconds per lookup. \n", (int)SELECTOR_COUNT,
+		seconds * 1000000000.0 / ((double)iterations * SELECTOR_COUNT));
+#endif
+	return 0;
+}
@@ -0,0 +1,97 @@
+#include "Test.h"
+#include <time.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#define THREADS 8
+#define ITERATIONS 100000
+
+int objc_sync_enter(id object);
+int objc_sync_exit(id object);
+
+static id objects[2];
+static long counters[2];
+
+/**
+ * Increments the counter belonging to each object while holding that
+ * object's monitor, sometimes recursively.
+ */
+static void *incrementCounters(void *arg)
+{
+	for (int i=0 ; i<ITERATIONS ; i++)
+	{
+		int n = i % 2;
+		@synchronized(objects[n])
+		{
+			long value = counters[n];
+			if (0 == (i % 16))
+			{
+				@synchronized(objects[n])
+				{
+					value++;
+				}
+			}
+			else
+			{
+				value++;
+			}
+			counters[n] = value;
+		}
+	}
+	return NULL;
+}
+
+int main(void)
+{
+	for (int i=0 ; i<2 ; i++)
+	{
+		objects[i] = [Test new];
+	}
+	pthread_t threads[THREADS];
+	for (int i=0 ; i<THREADS ; i++)
+	{
+		pthread_create(&threads[i], NULL, incrementCounters, NULL);
+	}
+	for (int i=0 ; i<THREADS ; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+	assert(counters[0] + counters[1] == THREADS * ITERATIONS);
+	// Ordinary objects must not be given a hidden class to hold the lock.
+	assert(*(Class*)objects[0] == [Test class]);
+	// Exiting a monitor that this thread does not hold is an error.
+	assert(0 != objc_sync_exit(objects[0]));
+	for (int i=0 ; i<2 ; i++)
+	{
+		[objects[i] dealloc];
+	}
+	// Monitors are released when objects are deallocated, so locking many
+	// short-lived objects must work.
+	for (int i=0 ; i<1000 ; i++)
+	{
+		id obj = [Test new];
+		assert(0 == objc_sync_enter(obj));
+		assert(0 == objc_sync_exit(obj));
+		[obj dealloc];
+	}
+#ifdef BENCHMARK
+	{
+		id obj = [Test new];
+		struct timespec t1, t2;
+		int iterations = 10000000;
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		for (int i=0 ; i<iterations ; i++)
+		{
+			objc_sync_enter(obj);
+			objc_sync_exit(obj);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+		double seconds = (t2.tv_sec - t1.tv_sec) +
+			((double)t2.tv_nsec - (double)t1.tv_nsec) / 1000000000.0;
+		printf("%f nanoseconds per uncontended @synchronized. \n",
+			seconds * 1000000000.0 / iterations);
+		[obj dealloc];
+	}
+#endif
+	return 0;
+}
@@ -0,0 +1,85 @@
+#include <time.h>
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <pthread.h>
+#include "../objc/runtime.h"
+
+#define SELECTOR_COUNT 1024
+#define MAX_THREADS 32
+
+static char names[SELECTOR_COUNT][32];
+static SEL selectors[SELECTOR_COUNT];
+
+struct thread_args
+{
+	int thread;
+	int iterations;
+	BOOL registerNew;
+};
+
+/**
+ * Repeatedly looks up existing selectors by name.  If registerNew is set,
+ * also registers new selectors, forcing the selector table to grow while
+ * other threads are reading it.
+ */
+static void *lookupSelectors(void *arg)
+{
+	struct thread_args *args = arg;
+	char buffer[64];
+	for (int i=0 ; i<args->iterations ; i++)
+	{
+		int n = i % SELECTOR_COUNT;
+		assert(selectors[n] == sel_registerName(names[n]));
+		if (args->registerNew && (0 == (i % 16)))
+		{
+			snprintf(buffer, sizeof(buffer), "thread%dselector%d", args->thread, i);
+			SEL sel = sel_registerName(buffer);
+			assert(strcmp(buffer, sel_getName(sel)) == 0);
+			assert(sel == sel_getUid(buffer));
+		}
+	}
+	return NULL;
+}
+
+static void runThreads(int count, int iterations, BOOL registerNew)
+{
+	pthread_t threads[MAX_THREADS];
+	struct thread_args args[MAX_THREADS];
+	for (int i=0 ; i<count ; i++)
+	{
+		args[i].thread = i;
+		args[i].iterations = iterations;
+		args[i].registerNew = registerNew;
+		pthread_create(&threads[i], NULL, lookupSelectors, &args[i]);
+	}
+	for (int i=0 ; i<count ; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+}
+
+int main(void)
+{
+	for (int i=0 ; i<SELECTOR_COUNT ; i++)
+	{
+		snprintf(names[i], sizeof(names[i]), "selector%dwithArgument:", i);
+		selectors[i] = sel_registerName(names[i]);
+	}
+	runThreads(8, 100000, YES);
+#ifdef BENCHMARK
+	for (int threads=1 ; threads<=MAX_THREADS ; threads*=2)
+	{
+		struct timespec t1, t2;
+		int iterations = 1000000;
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		runThreads(threads, iterations, NO);
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+		double seconds = (t2.tv_sec - t1.tv_sec) +
+			((double)t2.tv_nsec - (double)t1.tv_nsec) / 1000000000.0;
+		printf("%d threads: %f sel_registerName() calls per second. \n",
+			threads, ((double)threads * iterations) / seconds);
+	}
+#endif
+	return 0;
+}
@@ -0,0 +1,152 @@
+#include "Test.h"
+#include "../objc/objc-arc.h"
+#include <time.h>
+#include <stdio.h>
+#include <pthread.h>
+
+#define OBJECTS 64
+#define MAX_THREADS 64
+#define WEAK_REFS 8
+
+/**
+ * Objects that every thread stores weak references to, like delegates that
+ * are shared between many objects.
+ */
+static id shared[OBJECTS];
+
+struct thread_args
+{
+	int thread;
+	int iterations;
+	BOOL createObjects;
+};
+
+static void *weakRefs(void *arg)
+{
+	struct thread_args *args = arg;
+	id weak[WEAK_REFS];
+	for (int j=0 ; j<WEAK_REFS ; j++)
+	{
+		objc_initWeak(&weak[j], nil);
+	}
+	for (int i=0 ; i<args->iterations ; i++)
+	{
+		if (args->createObjects)
+		{
+			// More weak references than fit in one table entry, all of which
+			// must be zeroed when the object is deallocated.
+			id obj = [Test new];
+			for (int j=0 ; j<WEAK_REFS ; j++)
+			{
+				objc_storeWeak(&weak[j], obj);
+			}
+			for (int j=0 ; j<WEAK_REFS ; j++)
+			{
+				id loaded = objc_loadWeakRetained(&weak[j]);
+				assert(loaded == obj);
+				objc_release(loaded);
+			}
+			id moved;
+			objc_moveWeak(&moved, &weak[0]);
+			assert(nil == weak[0]);
+			assert(obj == moved);
+			objc_release(obj);
+			assert(nil == moved);
+			for (int j=1 ; j<WEAK_REFS ; j++)
+			{
+				assert(nil == weak[j]);
+			}
+		}
+		id obj = shared[(i + args->thread) % OBJECTS];
+		objc_storeWeak(&weak[0], obj);
+		id loaded = objc_loadWeakRetained(&weak[0]);
+		assert(loaded == obj);
+		objc_release(loaded);
+	}
+	for (int j=0 ; j<WEAK_REFS ; j++)
+	{
+		objc_destroyWeak(&weak[j]);
+	}
+	return NULL;
+}
+
+/**
+ * Stores more weak references to one object than fit inline, removing and
+ * moving some of them before the object is deallocated.
+ */
+static void manyWeakRefs(void)
+{
+	static id weak[256];
+	id moved[256];
+	id obj = [Test new];
+	for (int i=0 ; i<256 ; i++)
+	{
+		objc_initWeak(&weak[i], obj);
+	}
+	for (int i=0 ; i<256 ; i+=2)
+	{
+		objc_storeWeak(&weak[i], nil);
+	}
+	for (int i=1 ; i<256 ; i+=4)
+	{
+		objc_moveWeak(&moved[i], &weak[i]);
+		assert(nil == weak[i]);
+	}
+	for (int i=3 ; i<256 ; i+=4)
+	{
+		id loaded = objc_loadWeakRetained(&weak[i]);
+		assert(loaded == obj);
+		objc_release(loaded);
+	}
+	objc_release(obj);
+	for (int i=0 ; i<256 ; i++)
+	{
+		assert(nil == weak[i]);
+	}
+	for (int i=1 ; i<256 ; i+=4)
+	{
+		assert(nil == moved[i]);
+	}
+}
+
+static void runThreads(int count, int iterations, BOOL createObjects)
+{
+	pthread_t threads[MAX_THREADS];
+	struct thread_args args[MAX_THREADS];
+	for (int i=0 ; i<count ; i++)
+	{
+		args[i].thread = i;
+		args[i].iterations = iterations;
+		args[i].createObjects = createObjects;
+		pthread_create(&threads[i], NULL, weakRefs, &args[i]);
+	}
+	for (int i=0 ; i<count ; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+}
+
+int main(void)
+{
+	for (int i=0 ; i<OBJECTS ; i++)
+	{
+		shared[i] = [Test new];
+	}
+	manyWeakRefs();
+	runThreads(8, 10000, YES);
+#ifdef BENCHMARK
+	for (int threads=1 ; threads<=MAX_THREADS ; threads*=2)
+	{
+		struct timespec t1, t2;
+		int iterations = 1000000;
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		runThreads(threads, iterations, NO);
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+		double seconds = (t2.tv_sec - t1.tv_sec) +
+			((double)t2.tv_nsec - (double)t1.tv_nsec) / 1000000000.0;
+		printf("%d threads: %f weak store / load pairs per second. \n",
+			threads, ((double)threads * iterations) / seconds);
+	}
+#endif
+	return 0;
+}
@@ -70,6 +70,39 @@ __attribute__((objc_root_class))
 }
 + nothing { return 0; }
 @end
+
+static id picClass(id self, SEL _cmd)
+{
+	return (id)object_getClass(self);
+}
+static id picOverride(id self, SEL _cmd)
+{
+	return (id)0x42;
+}
+
+#ifdef BENCHMARK
+#if defined(__i386__) || defined(__x86_64__)
+/**
+ * Reads the time stamp counter.  The lfence stops the read from being
+ * reordered with respect to the loop being measured.
+ */
+static inline unsigned long long cycles(void)
+{
+	unsigned int lo, hi;
+	__asm__ __volatile__ ("lfence\n\trdtsc" : "=a"(lo), "=d"(hi) : : "memory");
+	return ((unsigned long long)hi << 32) | lo;
+}
+#endif
+#endif
+/**
+ * Sends -picClass via a polymorphic inline cache.
+ */
+static id cachedSend(id receiver, struct objc_slot_cache *cache)
+{
+	struct objc_slot *slot =
+		objc_slot_lookup_cached_np(&receiver, @selector(picClass), nil, cache);
+	return slot->method(receiver, @selector(picClass));
+}
 int main(void)
 {
 	TestCls = objc_getClass("Test");
@@ -99,6 +132,9 @@ int main(void)
 	assert(ret.c == 3);
 	assert(ret.d == 4);
 	assert(ret.e == 5);
+	// Variadic arguments, including floating point ones, must survive the fast
+	// path as well as the slow one.
+	objc_msgSend(TestCls, @selector(printf:), "Format %s %d %f%c", "string", 42, 42.0, '\n');
 	if (sizeof(id) == 8)
 	{
 		assert(objc_registerSmallObjectClass_np(objc_getClass("Test"), 3));
@@ -114,6 +150,46 @@ int main(void)
 	assert(0 == [f dzero]);
 	assert(0 == [f ldzero]);
 	assert(0 == [f fzero]);
+
+	Class picClasses[8];
+	id picObjects[8];
+	for (int i=0 ; i<8 ; i++)
+	{
+		char name[8];
+		snprintf(name, sizeof(name), "PIC%d", i);
+		picClasses[i] = objc_allocateClassPair(Nil, name, 0);
+		class_addMethod(picClasses[i], @selector(picClass), (IMP)picClass, "#@:");
+		objc_registerClassPair(picClasses[i]);
+		picObjects[i] = class_createInstance(picClasses[i], 0);
+	}
+	struct objc_slot_cache cache = {0};
+	for (int j=0 ; j<3 ; j++)
+	{
+		for (int i=0 ; i<4 ; i++)
+		{
+			assert((id)picClasses[i] == cachedSend(picObjects[i], &cache));
+		}
+	}
+	assert(0 == cache.evictions);
+	// Overriding a cached inherited method must invalidate the cache entry.
+	Class picSub = objc_allocateClassPair(picClasses[0], "PICSub", 0);
+	objc_registerClassPair(picSub);
+	id picSubObject = class_createInstance(picSub, 0);
+	struct objc_slot_cache subCache = {0};
+	assert((id)picSub == cachedSend(picSubObject, &subCache));
+	class_addMethod(picSub, @selector(picClass), (IMP)picOverride, "#@:");
+	assert((id)0x42 == cachedSend(picSubObject, &subCache));
+	assert((id)picClasses[0] == cachedSend(picObjects[0], &subCache));
+	// Cycling through more classes than the cache holds makes it megamorphic.
+	struct objc_slot_cache megaCache = {0};
+	for (int j=0 ; j<OBJC_SLOT_CACHE_MEGAMORPHIC ; j++)
+	{
+		for (int i=0 ; i<8 ; i++)
+		{
+			assert((id)picClasses[i] == cachedSend(picObjects[i], &megaCache));
+		}
+	}
+	assert(megaCache.evictions >= OBJC_SLOT_CACHE_MEGAMORPHIC);
 #ifdef BENCHMARK
 	clock_t c1, c2;
 	c1 = clock();
@@ -141,6 +217,52 @@ int main(void)
 	c2 = clock();
 	printf("Direct IMP call took %f seconds. \n", 
 		((double)c2 - (double)c1) / (double)CLOCKS_PER_SEC);
+#if defined(__i386__) || defined(__x86_64__)
+	// Cycles per send on the cache-hot fast path, with the loop overhead of an
+	// empty function call subtracted.
+	unsigned long long t1, t2, tDirect;
+	t1 = cycles();
+	for (int i=0 ; i<10000000 ; i++)
+	{
+		nothing(TestCls, @selector(nothing));
+	}
+	t2 = cycles();
+	tDirect = t2 - t1;
+	t1 = cycles();
+	for (int i=0 ; i<10000000 ; i++)
+	{
+		objc_msgSend(TestCls, @selector(nothing));
+	}
+	t2 = cycles();
+	printf("objc_msgSend() fast path took %f cycles per send. \n",
+		((double)(t2 - t1) - (double)tDirect) / 10000000.0);
+#endif
+	// Polymorphic inline cache, compared against objc_msgSend() with the
+	// same receivers.  Monomorphic sends use 1 class, polymorphic sends use 4
+	// and megamorphic sends use 8.
+	int shapes[] = { 1, 4, 8 };
+	const char *shapeNames[] = { "monomorphic", "4-way polymorphic", "megamorphic" };
+	for (int shape=0 ; shape<3 ; shape++)
+	{
+		int mask = shapes[shape] - 1;
+		struct objc_slot_cache benchCache = {0};
+		c1 = clock();
+		for (int i=0 ; i<100000000 ; i++)
+		{
+			cachedSend(picObjects[i & mask], &benchCache);
+		}
+		c2 = clock();
+		printf("Inline-cached %s send took %f seconds. \n", shapeNames[shape],
+			((double)c2 - (double)c1) / (double)CLOCKS_PER_SEC);
+		c1 = clock();
+		for (int i=0 ; i<100000000 ; i++)
+		{
+			objc_msgSend(picObjects[i & mask], @selector(picClass));
+		}
+		c2 = clock();
+		printf("objc_msgSend() %s send took %f seconds. \n", shapeNames[shape],
+			((double)c2 - (double)c1) / (double)CLOCKS_PER_SEC);
+	}
 #endif
 	return 0;
 }
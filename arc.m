@@ -10,6 +10,10 @@
 #import "objc/hooks.h"
 #import "objc/objc-arc.h"
 #import "objc/blocks_runtime.h"
+#import "dispatch_stats.h"
+#import "refcount.h"
+#include <string.h>
+#include <sched.h>
 
 #ifndef NO_PTHREADS
 #include <pthread.h>
@@ -51,16 +55,50 @@ struct arc_autorelease_pool
 	id pool[POOL_SIZE];
 };
 
+/**
+ * Maximum number of empty autorelease pool pages that each thread keeps for
+ * reuse.
+ */
+#define POOL_PAGE_CACHE_SIZE 4
+
 struct arc_tls
 {
 	struct arc_autorelease_pool *pool;
 	id returnRetained;
+	/**
+	 * Empty pool pages, linked through their previous pointers, that are
+	 * reused before allocating new ones.
+	 */
+	struct arc_autorelease_pool *freePages;
+	/**
+	 * Number of pages in the freePages list.
+	 */
+	unsigned int freePageCount;
 };
 
+#if defined(COMPILER_TLS) && !defined(NO_PTHREADS)
+/**
+ * The calling thread's ARC state.  The pthread key is only used to run
+ * cleanupPools() when the thread exits.
+ */
+static __thread struct arc_tls arcThreadData;
+/**
+ * Set when ARCThreadKey has been pointed at arcThreadData for this thread.
+ */
+static __thread BOOL arcThreadDataRegistered;
+#endif
+
 static inline struct arc_tls* getARCThreadData(void)
 {
 #ifdef NO_PTHREADS
 	return NULL;
+#elif defined(COMPILER_TLS)
+	if (UNLIKELY(!arcThreadDataRegistered))
+	{
+		arcThreadDataRegistered = YES;
+		pthread_setspecific(ARCThreadKey, &arcThreadData);
+	}
+	return &arcThreadData;
 #else
 	struct arc_tls *tls = pthread_getspecific(ARCThreadKey);
 	if (NULL == tls)
@@ -71,10 +109,462 @@ static inline struct arc_tls* getARCThreadData(void)
 	return tls;
 #endif
 }
+////////////////////////////////////////////////////////////////////////////////
+// Reference counts for fast-ARC objects
+////////////////////////////////////////////////////////////////////////////////
+
+#ifdef BIASED_REFCOUNT
+#ifndef COMPILER_TLS
+#	error Biased reference counting requires COMPILER_TLS
+#endif
+/**
+ * Biased reference counting.  Most objects are only ever retained and released
+ * by the thread that allocated them, so that thread (the owner) keeps its own
+ * count in the first header word, updated without atomic operations.  Other
+ * threads use the shared count in the second header word.  The object is only
+ * deallocated once the two counts have been merged:
+ *
+ * - When the owner releases its last biased reference, it sets the merged
+ *   flag in the shared word.  From then on, every thread uses the shared
+ *   count.
+ * - If another thread's release would take the unmerged shared count below
+ *   zero, it instead sets the queued flag and hands its reference to the
+ *   owner's queue.  The owner merges queued objects (adding its biased count to
+ *   the shared count) when it next allocates an object or pops an autorelease
+ *   pool, and when it exits.
+ *
+ * The shared word holds the count of references in its high bits.  A merged
+ * object is deallocated when this reaches zero.
+ */
+
+/** Number of bits in the biased word used for the owner's count. */
+#define BRC_COUNT_BITS 16
+#define BRC_COUNT_MASK ((((uintptr_t)1) << BRC_COUNT_BITS) - 1)
+/** Set in the shared word when the biased count has been merged into it. */
+#define BRC_MERGED 1
+/** Set in the shared word when the object is in its owner's queue. */
+#define BRC_QUEUED 2
+/** Shift for the count in the shared word. */
+#define BRC_SHARED_SHIFT 2
+#define BRC_SHARED_ONE (((intptr_t)1) << BRC_SHARED_SHIFT)
+/**
+ * Owner value for threads that do not own any objects.  No biased word can
+ * have this in its high bits.
+ */
+#define BRC_NO_OWNER UINTPTR_MAX
+
+struct brc_queue_node
+{
+	id obj;
+	struct brc_queue_node *next;
+};
+
+/**
+ * Per-thread state for biased reference counting.  These are never freed,
+ * because other threads may still queue objects for the thread after it has
+ * exited.
+ */
+struct brc_thread
+{
+	/** Objects waiting to be merged by this thread. */
+	struct brc_queue_node *queue;
+	/** Set when the thread has exited and will not drain its queue again. */
+	BOOL exited;
+};
+
+/** The calling thread, as stored in the high bits of the biased word. */
+static __thread uintptr_t brcOwner = BRC_NO_OWNER;
+/** The calling thread's state, or NULL if it has not allocated any objects. */
+static __thread struct brc_thread *brcSelf;
+/** Set when the calling thread has exited and may no longer own objects. */
+static __thread BOOL brcExited;
+#ifndef NO_PTHREADS
+static pthread_key_t brcThreadKey;
+#endif
+
+static inline uintptr_t *biasedCount(id obj)
+{
+	return ((uintptr_t*)obj) - 2;
+}
+
+static inline intptr_t *sharedCount(id obj)
+{
+	return ((intptr_t*)obj) - 1;
+}
+
+/**
+ * Merges the biased count of an object from the queue into its shared count,
+ * dropping the reference that the queue held.  Called by the owner, or by any
+ * thread once the owner has exited.
+ */
+static void brcMergeQueued(id obj)
+{
+	uintptr_t *biased = biasedCount(obj);
+	intptr_t *shared = sharedCount(obj);
+	intptr_t count = __atomic_load_n(biased, __ATOMIC_RELAXED) & BRC_COUNT_MASK;
+	intptr_t s = __atomic_load_n(shared, __ATOMIC_RELAXED);
+	intptr_t newShared;
+	do
+	{
+		newShared = (s | BRC_MERGED) + (count - 1) * BRC_SHARED_ONE;
+	} while (!__atomic_compare_exchange_n(shared, &s, newShared, 0,
+	                                      __ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+	// Other threads that see the cleared biased word must also see the merged
+	// flag, so this must come after setting it.
+	__atomic_store_n(biased, 0, __ATOMIC_RELEASE);
+	if ((newShared >> BRC_SHARED_SHIFT) == 0)
+	{
+		objc_delete_weak_refs(obj);
+		[obj dealloc];
+	}
+}
+
+static void brcDrainQueue(struct brc_thread *thread)
+{
+	struct brc_queue_node *node =
+		__atomic_exchange_n(&thread->queue, NULL, __ATOMIC_SEQ_CST);
+	while (NULL != node)
+	{
+		struct brc_queue_node *next = node->next;
+		brcMergeQueued(node->obj);
+		free(node);
+		node = next;
+	}
+}
+
+/**
+ * Hands an object, and one reference to it, to its owner's queue.
+ */
+static void brcEnqueue(struct brc_thread *owner, id obj)
+{
+	struct brc_queue_node *node = malloc(sizeof(struct brc_queue_node));
+	node->obj = obj;
+	node->next = __atomic_load_n(&owner->queue, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&owner->queue, &node->next, node, 0,
+	                                    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {}
+	// If the owner has exited, then it may have drained its queue for the last
+	// time before we pushed, so we must drain it ourselves.
+	if (__atomic_load_n(&owner->exited, __ATOMIC_SEQ_CST))
+	{
+		brcDrainQueue(owner);
+	}
+}
+
+#ifndef NO_PTHREADS
+static void brcThreadExit(void *thread)
+{
+	// After this, the thread treats objects that it owned like any other
+	// thread's, so nothing modifies their biased counts without atomics.
+	brcOwner = BRC_NO_OWNER;
+	brcSelf = NULL;
+	brcExited = YES;
+	__atomic_store_n(&((struct brc_thread*)thread)->exited, YES, __ATOMIC_SEQ_CST);
+	brcDrainQueue(thread);
+}
+#endif
+
+PRIVATE void init_refcount(id obj)
+{
+	struct brc_thread *thread = brcSelf;
+	if (UNLIKELY(NULL == thread) && !brcExited)
+	{
+		thread = calloc(1, sizeof(struct brc_thread));
+		// The thread is stored in the high bits of the biased word, so its
+		// address must fit.
+		if (((uintptr_t)thread >> (64 - BRC_COUNT_BITS)) == 0)
+		{
+			brcSelf = thread;
+			brcOwner = (uintptr_t)thread;
+#ifndef NO_PTHREADS
+			pthread_setspecific(brcThreadKey, thread);
+#endif
+		}
+		else
+		{
+			free(thread);
+			brcExited = YES;
+			thread = NULL;
+		}
+	}
+	if (NULL == thread)
+	{
+		*biasedCount(obj) = 0;
+		*sharedCount(obj) = BRC_MERGED | BRC_SHARED_ONE;
+		return;
+	}
+	if (UNLIKELY(NULL != __atomic_load_n(&thread->queue, __ATOMIC_RELAXED)))
+	{
+		brcDrainQueue(thread);
+	}
+	*biasedCount(obj) = (brcOwner << BRC_COUNT_BITS) | 1;
+	*sharedCount(obj) = 0;
+}
+
+/**
+ * Merges objects that other threads have queued for the calling thread.
+ */
+static inline void drainRefCountQueue(void)
+{
+	struct brc_thread *thread = brcSelf;
+	if ((NULL != thread) &&
+	    (NULL != __atomic_load_n(&thread->queue, __ATOMIC_RELAXED)))
+	{
+		brcDrainQueue(thread);
+	}
+}
+
+static inline void incrementRefCount(id obj)
+{
+	uintptr_t *biased = biasedCount(obj);
+	uintptr_t b = __atomic_load_n(biased, __ATOMIC_RELAXED);
+	if (((b >> BRC_COUNT_BITS) == brcOwner) &&
+	    ((b & BRC_COUNT_MASK) != BRC_COUNT_MASK))
+	{
+		__atomic_store_n(biased, b + 1, __ATOMIC_RELAXED);
+		return;
+	}
+	__atomic_fetch_add(sharedCount(obj), BRC_SHARED_ONE, __ATOMIC_RELAXED);
+}
+
+/**
+ * Drops a reference to an object.  Returns YES if it was the last one and the
+ * object must be deallocated.
+ */
+static inline BOOL decrementRefCount(id obj)
+{
+	uintptr_t *biased = biasedCount(obj);
+	intptr_t *shared = sharedCount(obj);
+	// Acquire, so that if the owner has cleared this then we also see the
+	// merged flag.
+	uintptr_t b = __atomic_load_n(biased, __ATOMIC_ACQUIRE);
+	if ((b >> BRC_COUNT_BITS) == brcOwner)
+	{
+		if ((b & BRC_COUNT_MASK) > 1)
+		{
+			__atomic_store_n(biased, b - 1, __ATOMIC_RELAXED);
+			return NO;
+		}
+		// Our last biased reference, so merge.  Any references held by the
+		// queue are in the shared count, so the object is not freed while it
+		// is queued.
+		intptr_t s = __atomic_fetch_or(shared, BRC_MERGED, __ATOMIC_ACQ_REL);
+		__atomic_store_n(biased, 0, __ATOMIC_RELEASE);
+		return (s >> BRC_SHARED_SHIFT) == 0;
+	}
+	intptr_t s = __atomic_load_n(shared, __ATOMIC_RELAXED);
+	for (;;)
+	{
+		if ((s & (BRC_MERGED | BRC_QUEUED)) == 0 &&
+		    ((s >> BRC_SHARED_SHIFT) == 0))
+		{
+			if (__atomic_compare_exchange_n(shared, &s, s | BRC_QUEUED, 0,
+			                                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			{
+				brcEnqueue((struct brc_thread*)(b >> BRC_COUNT_BITS), obj);
+				return NO;
+			}
+			continue;
+		}
+		if (__atomic_compare_exchange_n(shared, &s, s - BRC_SHARED_ONE, 0,
+		                                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		{
+			return (s & BRC_MERGED) && ((s >> BRC_SHARED_SHIFT) == 1);
+		}
+	}
+}
+
+/**
+ * Returns YES if the object's last reference has been released.
+ */
+static inline BOOL isDeallocating(id obj)
+{
+	intptr_t s = __atomic_load_n(sharedCount(obj), __ATOMIC_RELAXED);
+	return (s & BRC_MERGED) && ((s >> BRC_SHARED_SHIFT) <= 0);
+}
+
+/**
+ * Adds a reference to the object unless it is being deallocated.  Returns NO
+ * if it is.
+ */
+static inline BOOL tryIncrementRefCount(id obj)
+{
+	intptr_t *shared = sharedCount(obj);
+	intptr_t s = __atomic_load_n(shared, __ATOMIC_RELAXED);
+	do
+	{
+		if ((s & BRC_MERGED) && ((s >> BRC_SHARED_SHIFT) <= 0))
+		{
+			return NO;
+		}
+	} while (!__atomic_compare_exchange_n(shared, &s, s + BRC_SHARED_ONE, 0,
+	                                      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+	return YES;
+}
+#else
+static inline void drainRefCountQueue(void) {}
+
+static inline void incrementRefCount(id obj)
+{
+	intptr_t *refCount = ((intptr_t*)obj) - 1;
+	__sync_add_and_fetch(refCount, 1);
+}
+
+/**
+ * Drops a reference to an object.  Returns YES if it was the last one and the
+ * object must be deallocated.
+ */
+static inline BOOL decrementRefCount(id obj)
+{
+	intptr_t *refCount = ((intptr_t*)obj) - 1;
+	return __sync_sub_and_fetch(refCount, 1) < 0;
+}
+
+/**
+ * Returns YES if the object's last reference has been released.
+ */
+static inline BOOL isDeallocating(id obj)
+{
+	// A negative reference count means that the object is being deallocated.
+	return __atomic_load_n(((intptr_t*)obj) - 1, __ATOMIC_RELAXED) < 0;
+}
+
+/**
+ * Adds a reference to the object unless it is being deallocated.  Returns NO
+ * if it is.
+ */
+static inline BOOL tryIncrementRefCount(id obj)
+{
+	intptr_t *refCount = ((intptr_t*)obj) - 1;
+	intptr_t count = __atomic_load_n(refCount, __ATOMIC_RELAXED);
+	do
+	{
+		if (count < 0)
+		{
+			return NO;
+		}
+	} while (!__atomic_compare_exchange_n(refCount, &count, count+1, 0,
+	                                      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+	return YES;
+}
+#endif
+
 int count = 0;
 int poolCount = 0;
 static inline void release(id obj);
 
+/**
+ * Pushes a new page onto the thread's autorelease pool stack, reusing a cached
+ * page if there is one.  Pages are not zeroed: nothing above the insert
+ * pointer is ever read.
+ */
+static inline struct arc_autorelease_pool *newPoolPage(struct arc_tls *tls)
+{
+	struct arc_autorelease_pool *pool = tls->freePages;
+	if (NULL != pool)
+	{
+		tls->freePages = pool->previous;
+		tls->freePageCount--;
+	}
+	else
+	{
+		pool = malloc(sizeof(struct arc_autorelease_pool));
+	}
+	pool->previous = tls->pool;
+	pool->insert = pool->pool;
+	tls->pool = pool;
+	return pool;
+}
+
+/**
+ * Returns an empty page to the thread's cache, or frees it if the cache is
+ * full.
+ */
+static inline void recyclePoolPage(struct arc_tls *tls,
+                                   struct arc_autorelease_pool *pool)
+{
+	if (tls->freePageCount >= POOL_PAGE_CACHE_SIZE)
+	{
+		free(pool);
+		return;
+	}
+	pool->previous = tls->freePages;
+	tls->freePages = pool;
+	tls->freePageCount++;
+}
+
+/**
+ * Number of pool entries ahead of the one being released whose objects are
+ * prefetched while draining.
+ */
+#define POOL_PREFETCH_DISTANCE 8
+
+/**
+ * Returns YES if objects of this class can be released by directly
+ * decrementing their reference count.  This must agree with release().
+ */
+static inline BOOL isFastARCClass(Class cls)
+{
+	return (cls != (Class)&_NSConcreteMallocBlock) &&
+	       (cls != (Class)&_NSConcreteStackBlock) &&
+	       (cls != (Class)&_NSConcreteGlobalBlock) &&
+	       objc_test_class_flag(cls, objc_class_flag_fast_arc);
+}
+
+/**
+ * Prefetches the reference count of an object that will be retained or
+ * released soon.
+ */
+static inline void prefetchRefCount(id obj)
+{
+	if ((nil != obj) && !isSmallObject(obj))
+	{
+		__builtin_prefetch(((intptr_t*)obj) - 1, 1);
+	}
+}
+
+/**
+ * Releases objects from the top page of the autorelease pool, until its insert
+ * point reaches stop.  Pools usually contain long runs of objects of the same
+ * class, so the class is only checked when it differs from that of the
+ * previous object.  Returns early if a -dealloc autoreleases enough objects
+ * to push a new page, which the caller must drain first.
+ */
+static void drainPoolPage(struct arc_tls *tls, id *stop)
+{
+	struct arc_autorelease_pool *pool = tls->pool;
+	// The class of the last fast-ARC object released, or Nil.
+	Class runClass = Nil;
+	while ((tls->pool == pool) && (pool->insert > stop))
+	{
+		id *next = pool->insert - 1;
+		if (next - stop >= POOL_PREFETCH_DISTANCE)
+		{
+			prefetchRefCount(*(next - POOL_PREFETCH_DISTANCE));
+		}
+		id obj = *next;
+		// The object may autorelease others in -dealloc, so the insert point
+		// must be moved before it is released.
+		pool->insert = next;
+		count--;
+		if (isSmallObject(obj)) { continue; }
+		Class cls = obj->isa;
+		if (cls != runClass)
+		{
+			if (!isFastARCClass(cls))
+			{
+				release(obj);
+				continue;
+			}
+			runClass = cls;
+		}
+		if (decrementRefCount(obj))
+		{
+			objc_delete_weak_refs(obj);
+			[obj dealloc];
+		}
+	}
+}
+
 /**
  * Empties objects from the autorelease pool, stating at the head of the list
  * specified by pool and continuing until it reaches the stop point.  If the stop point is NULL then 
@@ -105,31 +595,23 @@ static void emptyPool(struct arc_tls *tls, id *stop)
 			stopPool = stopPool->previous;
 		}
 	}
-	while (tls->pool != stopPool)
+	while (NULL != tls->pool)
 	{
-		while (tls->pool->insert > tls->pool->pool)
+		struct arc_autorelease_pool *pool = tls->pool;
+		drainPoolPage(tls, (pool == stopPool) ? stop : pool->pool);
+		// Releasing objects may autorelease others, so we have to work in the
+		// case where the autorelease pool is extended by a new page.
+		if (tls->pool != pool)
 		{
-			tls->pool->insert--;
-			// This may autorelease some other objects, so we have to work in
-			// the case where the autorelease pool is extended during a -release.
-			release(*tls->pool->insert);
-			count--;
+			continue;
 		}
-		void *old = tls->pool;
-		tls->pool = tls->pool->previous;
-		free(old);
-	}
-	if (NULL != tls->pool)
-	{
-		while ((stop == NULL || (tls->pool->insert > stop)) &&
-		       (tls->pool->insert > tls->pool->pool))
+		if (pool == stopPool)
 		{
-			tls->pool->insert--;
-			count--;
-			release(*tls->pool->insert);
+			break;
 		}
+		tls->pool = pool->previous;
+		recyclePoolPage(tls, pool);
 	}
-	//fprintf(stderr, "New insert: %p.  Stop: %p\n", tls->pool->insert, stop);
 }
 
 static void cleanupPools(struct arc_tls* tls)
@@ -147,8 +629,22 @@ static void cleanupPools(struct arc_tls* tls)
 	if (tls->returnRetained)
 	{
 		cleanupPools(tls);
+		return;
+	}
+	while (NULL != tls->freePages)
+	{
+		struct arc_autorelease_pool *pool = tls->freePages;
+		tls->freePages = pool->previous;
+		free(pool);
 	}
+	tls->freePageCount = 0;
+#ifdef COMPILER_TLS
+	// The thread data is not freed, but the key must be set again if another
+	// thread-exit destructor autoreleases anything.
+	arcThreadDataRegistered = NO;
+#else
 	free(tls);
+#endif
 }
 
 
@@ -174,8 +670,7 @@ static inline id retain(id obj)
 	}
 	if (objc_test_class_flag(cls, objc_class_flag_fast_arc))
 	{
-		intptr_t *refCount = ((intptr_t*)obj) - 1;
-		__sync_add_and_fetch(refCount, 1);
+		incrementRefCount(obj);
 		return obj;
 	}
 	return [obj retain];
@@ -197,8 +692,7 @@ static inline void release(id obj)
 	}
 	if (objc_test_class_flag(cls, objc_class_flag_fast_arc))
 	{
-		intptr_t *refCount = ((intptr_t*)obj) - 1;
-		if (__sync_sub_and_fetch(refCount, 1) < 0)
+		if (decrementRefCount(obj))
 		{
 			objc_delete_weak_refs(obj);
 			[obj dealloc];
@@ -208,6 +702,26 @@ static inline void release(id obj)
 	[obj release];
 }
 
+/**
+ * Retains an object if that can be done by directly incrementing its reference
+ * count, without sending a message.  Returns NO, without retaining the object,
+ * if it can't.  The caller must ensure that the object can't be deallocated
+ * concurrently.
+ */
+PRIVATE BOOL isFastARCObject(id obj)
+{
+	return (nil != obj) && !isSmallObject(obj) &&
+	       isFastARCClass(classForObject(obj));
+}
+
+PRIVATE BOOL retainIfFastARC(id obj)
+{
+	if ((nil == obj) || isSmallObject(obj)) { return YES; }
+	if (!isFastARCClass(classForObject(obj))) { return NO; }
+	incrementRefCount(obj);
+	return YES;
+}
+
 static inline void initAutorelease(void)
 {
 	if (Nil == AutoreleasePool)
@@ -243,10 +757,7 @@ static inline id autorelease(id obj)
 			struct arc_autorelease_pool *pool = tls->pool;
 			if (NULL == pool || (pool->insert >= &pool->pool[POOL_SIZE]))
 			{
-				pool = calloc(sizeof(struct arc_autorelease_pool), 1);
-				pool->previous = tls->pool;
-				pool->insert = pool->pool;
-				tls->pool = pool;
+				pool = newPoolPage(tls);
 			}
 			count++;
 			*pool->insert = obj;
@@ -321,10 +832,7 @@ void *objc_autoreleasePoolPush(void)
 			struct arc_autorelease_pool *pool = tls->pool;
 			if (NULL == pool || (pool->insert >= &pool->pool[POOL_SIZE]))
 			{
-				pool = calloc(sizeof(struct arc_autorelease_pool), 1);
-				pool->previous = tls->pool;
-				pool->insert = pool->pool;
-				tls->pool = pool;
+				pool = newPoolPage(tls);
 			}
 			// If there is no autorelease pool allocated for this thread, then
 			// we lazily allocate one the first time something is autoreleased.
@@ -337,11 +845,19 @@ void *objc_autoreleasePoolPush(void)
 }
 void objc_autoreleasePoolPop(void *pool)
 {
+	drainRefCountQueue();
 	if (useARCAutoreleasePool)
 	{
 		struct arc_tls* tls = getARCThreadData();
 		if (NULL != tls)
 		{
+			// A return value that was handed over but never claimed was
+			// logically autoreleased into the innermost pool.
+			if (nil != tls->returnRetained)
+			{
+				release(tls->returnRetained);
+				tls->returnRetained = nil;
+			}
 			if (NULL != tls->pool)
 			{
 				emptyPool(tls, pool);
@@ -367,6 +883,98 @@ id objc_autorelease(id obj)
 	return obj;
 }
 
+#if defined(__x86_64__) && defined(__ELF__) && !defined(NO_PTHREADS)
+/**
+ * Returns YES if the code at the return address passes the return value
+ * straight to objc_retainAutoreleasedReturnValue().  For that, clang emits:
+ *
+ *   mov %rax, %rdi
+ *   call objc_retainAutoreleasedReturnValue
+ *
+ * The call is either direct, via a PLT stub, or through the GOT when compiled
+ * with -fno-plt.  If the PLT entry has not been bound yet then this returns
+ * NO, and the value is autoreleased as normal.
+ */
+static BOOL callerRetainsReturnValue(const unsigned char *ip)
+{
+	static const unsigned char movRaxRdi[] = { 0x48, 0x89, 0xc7 };
+	static const unsigned char endbr64[] = { 0xf3, 0x0f, 0x1e, 0xfa };
+	const void *target;
+	int32_t offset;
+	if (memcmp(ip, movRaxRdi, sizeof(movRaxRdi)) != 0)
+	{
+		return NO;
+	}
+	ip += sizeof(movRaxRdi);
+	// call rel32
+	if (0xe8 == ip[0])
+	{
+		memcpy(&offset, ip + 1, sizeof(offset));
+		const unsigned char *stub = ip + 5 + offset;
+		if (stub == (const void*)objc_retainAutoreleasedReturnValue)
+		{
+			return YES;
+		}
+		// The PLT stub is jmp *GOT(%rip), optionally preceded by endbr64 and
+		// a bnd prefix when built with control-flow protection.
+		if (memcmp(stub, endbr64, sizeof(endbr64)) == 0)
+		{
+			stub += sizeof(endbr64);
+		}
+		if (0xf2 == stub[0])
+		{
+			stub++;
+		}
+		if ((0xff != stub[0]) || (0x25 != stub[1]))
+		{
+			return NO;
+		}
+		memcpy(&offset, stub + 2, sizeof(offset));
+		target = *(void**)(stub + 6 + offset);
+	}
+	// call *GOT(%rip)
+	else if ((0xff == ip[0]) && (0x15 == ip[1]))
+	{
+		memcpy(&offset, ip + 2, sizeof(offset));
+		target = *(void**)(ip + 6 + offset);
+	}
+	else
+	{
+		return NO;
+	}
+	return target == (const void*)objc_retainAutoreleasedReturnValue;
+}
+
+/**
+ * Autoreleases a return value, unless the caller (identified by the return
+ * address) is going to retain it immediately.  In that case, the value is
+ * stored in TLS and objc_retainAutoreleasedReturnValue() takes it from there,
+ * so the autorelease pool is never touched.
+ */
+static inline id autoreleaseReturnValue(id obj, const void *returnAddress)
+{
+	struct arc_tls* tls = getARCThreadData();
+	if ((NULL != tls) && callerRetainsReturnValue(returnAddress))
+	{
+		// If the last value handed over was never claimed, then it needs
+		// autoreleasing now.
+		if (nil != tls->returnRetained)
+		{
+			DISPATCH_STAT(RETURN_AUTORELEASED);
+			objc_autorelease(tls->returnRetained);
+		}
+		tls->returnRetained = obj;
+		return obj;
+	}
+	DISPATCH_STAT(RETURN_AUTORELEASED);
+	return objc_autorelease(obj);
+}
+
+id objc_autoreleaseReturnValue(id obj)
+{
+	return autoreleaseReturnValue(obj, __builtin_return_address(0));
+}
+#else
 id objc_autoreleaseReturnValue(id obj)
 {
 	if (!useARCAutoreleasePool) 
@@ -379,8 +987,10 @@ id objc_autoreleaseReturnValue(id obj)
 			return obj;
 		}
 	}
+	DISPATCH_STAT(RETURN_AUTORELEASED);
 	return objc_autorelease(obj);
 }
+#endif
 
 id objc_retainAutoreleasedReturnValue(id obj)
 {
@@ -395,21 +1005,23 @@ id objc_retainAutoreleasedReturnValue(id obj)
 	struct arc_tls* tls = getARCThreadData();
 	if (NULL != tls)
 	{
+		if ((nil != obj) && (obj == tls->returnRetained))
+		{
+			DISPATCH_STAT(RETURN_ELIDED);
+			tls->returnRetained = NULL;
+			return obj;
+		}
 		// If we're using our own autorelease pool, just pop the object from the top
 		if (useARCAutoreleasePool)
 		{
 			if ((NULL != tls->pool) &&
+			    (tls->pool->insert > tls->pool->pool) &&
 			    (*(tls->pool->insert-1) == obj))
 			{
 				tls->pool->insert--;
 				return obj;
 			}
 		}
-		else if (obj == tls->returnRetained)
-		{
-			tls->returnRetained = NULL;
-			return obj;
-		}
 	}
 	return objc_retain(obj);
 }
@@ -420,6 +1032,62 @@ id objc_retain(id obj)
 	return retain(obj);
 }
 
+void objc_retainArray_np(id *objects, size_t count)
+{
+	// The class of the last fast-ARC object retained, or Nil.
+	Class runClass = Nil;
+	for (size_t i=0 ; i<count ; i++)
+	{
+		if (i + POOL_PREFETCH_DISTANCE < count)
+		{
+			prefetchRefCount(objects[i + POOL_PREFETCH_DISTANCE]);
+		}
+		id obj = objects[i];
+		if ((nil == obj) || isSmallObject(obj)) { continue; }
+		Class cls = obj->isa;
+		if (cls != runClass)
+		{
+			if (!isFastARCClass(cls))
+			{
+				objects[i] = retain(obj);
+				continue;
+			}
+			runClass = cls;
+		}
+		incrementRefCount(obj);
+	}
+}
+
+void objc_releaseArray_np(id *objects, size_t count)
+{
+	// The class of the last fast-ARC object released, or Nil.
+	Class runClass = Nil;
+	for (size_t i=0 ; i<count ; i++)
+	{
+		if (i + POOL_PREFETCH_DISTANCE < count)
+		{
+			prefetchRefCount(objects[i + POOL_PREFETCH_DISTANCE]);
+		}
+		id obj = objects[i];
+		if ((nil == obj) || isSmallObject(obj)) { continue; }
+		Class cls = obj->isa;
+		if (cls != runClass)
+		{
+			if (!isFastARCClass(cls))
+			{
+				release(obj);
+				continue;
+			}
+			runClass = cls;
+		}
+		if (decrementRefCount(obj))
+		{
+			objc_delete_weak_refs(obj);
+			[obj dealloc];
+		}
+	}
+}
+
 id objc_retainAutorelease(id obj)
 {
 	return objc_autorelease(objc_retain(obj));
@@ -428,7 +1096,11 @@ id objc_retainAutorelease(id obj)
 id objc_retainAutoreleaseReturnValue(id obj)
 {
 	if (nil == obj) { return obj; }
+#if defined(__x86_64__) && defined(__ELF__) && !defined(NO_PTHREADS)
+	return autoreleaseReturnValue(retain(obj), __builtin_return_address(0));
+#else
 	return objc_autoreleaseReturnValue(retain(obj));
+#endif
 }
 
 
@@ -456,11 +1128,37 @@ id objc_storeStrong(id *addr, id value)
 // Weak references
 ////////////////////////////////////////////////////////////////////////////////
 
+/**
+ * Number of weak references to an object that are stored in its table entry.
+ */
+#define WEAK_REF_INLINE 4
+
+/**
+ * The weak references to an object.  Most objects have only a few, which are
+ * stored inline.  Beyond that, the addresses are stored in an open-addressed
+ * set, so adding or removing one costs the same no matter how many there are.
+ */
 typedef struct objc_weak_ref
 {
 	id obj;
-	id *ref[4];
-	struct objc_weak_ref *next;
+	/** Number of weak references stored. */
+	uint32_t count;
+	/**
+	 * Number of slots in the out-of-line set (always a power of two), or 0 if
+	 * the references are stored inline.
+	 */
+	uint32_t capacity;
+	/**
+	 * Number of threads in objc_loadWeakRetained() that are calling out to
+	 * load this object without holding the stripe lock.  The entry is not
+	 * removed until this drops to zero.
+	 */
+	uint32_t loading;
+	union
+	{
+		id *ref[WEAK_REF_INLINE];
+		id **refs;
+	};
 } WeakRef;
 
 
@@ -475,6 +1173,151 @@ static uint32_t ptr_hash(const void *ptr)
 	// always be 0, which is not so useful for a hash value
 	return ((uintptr_t)ptr >> 4) | ((uintptr_t)ptr << ((sizeof(id) * 8) - 4));
 }
+
+/**
+ * Returns the address of the storage for weak references in an entry, and the
+ * number of slots in it.
+ */
+static inline id **weak_ref_slots(WeakRef *ref, uint32_t *size)
+{
+	if (0 == ref->capacity)
+	{
+		*size = WEAK_REF_INLINE;
+		return ref->ref;
+	}
+	*size = ref->capacity;
+	return ref->refs;
+}
+
+/**
+ * Inserts an address into an out-of-line set, which must have a free slot.
+ */
+static inline void weak_ref_set_insert(id **refs, uint32_t capacity, id *addr)
+{
+	uint32_t mask = capacity - 1;
+	for (uint32_t i=ptr_hash(addr) & mask ; ; i=(i+1) & mask)
+	{
+		if (NULL == refs[i])
+		{
+			refs[i] = addr;
+			return;
+		}
+	}
+}
+
+/**
+ * Adds a weak reference to an object's entry, moving the references to a
+ * larger out-of-line set if there is no space.
+ */
+static void weak_ref_entry_add(WeakRef *ref, id *addr)
+{
+	if (0 == ref->capacity)
+	{
+		if (ref->count < WEAK_REF_INLINE)
+		{
+			for (int i=0 ; i<WEAK_REF_INLINE ; i++)
+			{
+				if (NULL == ref->ref[i])
+				{
+					ref->ref[i] = addr;
+					ref->count++;
+					return;
+				}
+			}
+		}
+	}
+	// Keep the set at most three quarters full, so that probe sequences stay
+	// short.
+	else if ((ref->count + 1) * 4 <= ref->capacity * 3)
+	{
+		weak_ref_set_insert(ref->refs, ref->capacity, addr);
+		ref->count++;
+		return;
+	}
+	uint32_t size;
+	id **old = weak_ref_slots(ref, &size);
+	uint32_t capacity = (0 == ref->capacity) ? 16 : ref->capacity * 2;
+	id **refs = calloc(capacity, sizeof(id*));
+	for (uint32_t i=0 ; i<size ; i++)
+	{
+		if (NULL != old[i])
+		{
+			weak_ref_set_insert(refs, capacity, old[i]);
+		}
+	}
+	if (0 != ref->capacity)
+	{
+		free(old);
+	}
+	weak_ref_set_insert(refs, capacity, addr);
+	ref->refs = refs;
+	ref->capacity = capacity;
+	ref->count++;
+}
+
+/**
+ * Finds the slot holding a weak reference in an object's entry.  Returns NULL
+ * if the address is not registered.
+ */
+static id **weak_ref_entry_find(WeakRef *ref, id *addr)
+{
+	if (0 == ref->capacity)
+	{
+		for (int i=0 ; i<WEAK_REF_INLINE ; i++)
+		{
+			if (ref->ref[i] == addr)
+			{
+				return &ref->ref[i];
+			}
+		}
+		return NULL;
+	}
+	uint32_t mask = ref->capacity - 1;
+	for (uint32_t i=ptr_hash(addr) & mask ; NULL != ref->refs[i] ; i=(i+1) & mask)
+	{
+		if (ref->refs[i] == addr)
+		{
+			return &ref->refs[i];
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Removes a weak reference from an object's entry.  Returns NO if the address
+ * was not registered.
+ */
+static BOOL weak_ref_entry_remove(WeakRef *ref, id *addr)
+{
+	id **slot = weak_ref_entry_find(ref, addr);
+	if (NULL == slot)
+	{
+		return NO;
+	}
+	*slot = NULL;
+	ref->count--;
+	if (0 == ref->capacity)
+	{
+		return YES;
+	}
+	// Shift later entries in the probe sequence back into the gap, so that
+	// lookups never need to skip over deleted entries.
+	uint32_t mask = ref->capacity - 1;
+	uint32_t gap = slot - ref->refs;
+	for (uint32_t i=(gap+1) & mask ; NULL != ref->refs[i] ; i=(i+1) & mask)
+	{
+		uint32_t home = ptr_hash(ref->refs[i]) & mask;
+		// Move the entry if the gap lies between its home slot and where it
+		// is now, allowing for wrapping around the end of the set.
+		if (((i - home) & mask) >= ((i - gap) & mask))
+		{
+			ref->refs[gap] = ref->refs[i];
+			ref->refs[i] = NULL;
+			gap = i;
+		}
+	}
+	return YES;
+}
 static int weak_ref_hash(const WeakRef weak_ref)
 {
 	return ptr_hash(weak_ref.obj);
@@ -498,39 +1341,108 @@ const static WeakRef NullWeakRef;
 
 #include "hash_table.h"
 
-static weak_ref_table *weakRefs;
-mutex_t weakRefLock;
+/**
+ * Number of independently locked weak reference tables.  Must be a power of
+ * two.
+ */
+#define WEAK_REF_STRIPES 64
+
+/**
+ * A weak reference table and the lock that protects it.  Each object's weak
+ * references are all stored in the stripe selected by its address, so threads
+ * using weak references to different objects rarely contend.
+ *
+ * The _objc_weak_load() hook and -retain may use weak references to objects
+ * in any stripe, so they are never called with a stripe lock held.  Otherwise
+ * two threads could each hold one stripe lock and wait for the other's.
+ */
+struct weak_ref_stripe
+{
+	mutex_t lock;
+	/** Created the first time an object in this stripe is stored. */
+	weak_ref_table *table;
+	/**
+	 * Numbers of threads loading a weak reference to an object in this
+	 * stripe without holding the lock.  Readers increment the counter that
+	 * the low bit of epoch selects.  Deallocation flips the epoch and waits
+	 * only for the old counter to drop to zero, so new readers can not delay
+	 * it indefinitely.
+	 */
+	long readers[2];
+	unsigned int epoch;
+} __attribute__((aligned(64)));
+
+static struct weak_ref_stripe weakRefStripes[WEAK_REF_STRIPES];
+
+static inline struct weak_ref_stripe *weak_ref_stripe_for(id obj)
+{
+	if (nil == obj) { return NULL; }
+	// The tables within a stripe use the low bits of ptr_hash(), so select
+	// the stripe with the high bits of a different hash.
+	uint32_t hash = (uint32_t)((uintptr_t)obj >> 4) * 2654435761U;
+	return &weakRefStripes[hash >> (32 - __builtin_ctz(WEAK_REF_STRIPES))];
+}
+
+static inline WeakRef *weak_ref_get(struct weak_ref_stripe *stripe, id obj)
+{
+	if ((NULL == stripe) || (NULL == stripe->table)) { return NULL; }
+	return weak_ref_table_get(stripe->table, obj);
+}
+
+/**
+ * Locks the stripes for two objects, in a consistent order so that two
+ * threads locking the same pair can not deadlock.  Either may be NULL.
+ */
+static inline void weak_ref_lock_two(struct weak_ref_stripe *a,
+                                     struct weak_ref_stripe *b)
+{
+	if (a > b)
+	{
+		struct weak_ref_stripe *tmp = a;
+		a = b;
+		b = tmp;
+	}
+	if (NULL != a) { LOCK(&a->lock); }
+	if ((NULL != b) && (a != b)) { LOCK(&b->lock); }
+}
+
+static inline void weak_ref_unlock_two(struct weak_ref_stripe *a,
+                                       struct weak_ref_stripe *b)
+{
+	if (NULL != a) { UNLOCK(&a->lock); }
+	if ((NULL != b) && (a != b)) { UNLOCK(&b->lock); }
+}
 
 PRIVATE void init_arc(void)
 {
-	weak_ref_initialize(&weakRefs, 128);
-	INIT_LOCK(weakRefLock);
+	for (int i=0 ; i<WEAK_REF_STRIPES ; i++)
+	{
+		INIT_LOCK(weakRefStripes[i].lock);
+	}
 #ifndef NO_PTHREADS
 	pthread_key_create(&ARCThreadKey, (void(*)(void*))cleanupPools);
+#ifdef BIASED_REFCOUNT
+	pthread_key_create(&brcThreadKey, brcThreadExit);
+#endif
 #endif
 }
 
 void* block_load_weak(void *block);
 
-id objc_storeWeak(id *addr, id obj)
+/**
+ * Stores a weak reference.  Must be called with the stripes for both the old
+ * and new values locked.
+ */
+static id storeWeakLocked(id *addr, id old, id obj,
+                          struct weak_ref_stripe *oldStripe,
+                          struct weak_ref_stripe *newStripe)
 {
-	id old = *addr;
-	LOCK_FOR_SCOPE(&weakRefLock);
 	if (nil != old)
 	{
-		WeakRef *oldRef = weak_ref_table_get(weakRefs, old);
-		while (NULL != oldRef)
+		WeakRef *oldRef = weak_ref_get(oldStripe, old);
+		if (NULL != oldRef)
 		{
-			for (int i=0 ; i<4 ; i++)
-			{
-				if (oldRef->ref[i] == addr)
-				{
-					oldRef->ref[i] = 0;
-					oldRef = 0;
-					break;
-				}
-			}
-			oldRef = (oldRef == NULL) ? NULL : oldRef->next;
+			weak_ref_entry_remove(oldRef, addr);
 		}
 	}
 	if (nil == obj)
@@ -554,107 +1466,224 @@ id objc_storeWeak(id *addr, id obj)
 	}
 	else if (objc_test_class_flag(cls, objc_class_flag_fast_arc))
 	{
-		if ((*(((intptr_t*)obj) - 1)) < 0)
+		if (isDeallocating(obj))
 		{
 			return nil;
 		}
 	}
-	else
-	{
-		obj = _objc_weak_load(obj);
-	}
 	if (nil != obj)
 	{
-		WeakRef *ref = weak_ref_table_get(weakRefs, obj);
-		while (NULL != ref)
+		if (NULL == newStripe->table)
 		{
-			for (int i=0 ; i<4 ; i++)
-			{
-				if (0 == ref->ref[i])
-				{
-					ref->ref[i] = addr;
-					*addr = obj;
-					return obj;
-				}
-			}
-			if (ref->next == NULL)
-			{
-				break;
-			}
-			ref = ref->next;
+			newStripe->table = weak_ref_create(32);
 		}
+		WeakRef *ref = weak_ref_table_get(newStripe->table, obj);
 		if (NULL != ref)
 		{
-			ref->next = calloc(sizeof(WeakRef), 1);
-			ref->next->ref[0] = addr;
+			weak_ref_entry_add(ref, addr);
 		}
 		else
 		{
 			WeakRef newRef = {0};
 			newRef.obj = obj;
+			newRef.count = 1;
 			newRef.ref[0] = addr;
-			weak_ref_insert(weakRefs, newRef);
+			weak_ref_insert(newStripe->table, newRef);
 		}
 	}
 	*addr = obj;
 	return obj;
 }
 
-static void zeroRefs(WeakRef *ref, BOOL shouldFree)
+id objc_storeWeak(id *addr, id obj)
 {
-	if (NULL != ref->next)
+	// Call the _objc_weak_load() hook before taking any locks, because it may
+	// use weak references to objects in other stripes.  The caller holds a
+	// strong reference, so the object can't be deallocated in the meantime.
+	if (nil != obj)
 	{
-		zeroRefs(ref->next, YES);
+		Class cls = classForObject(obj);
+		if ((&_NSConcreteGlobalBlock != cls) &&
+		    (&_NSConcreteMallocBlock != cls) &&
+		    !objc_test_class_flag(cls, objc_class_flag_fast_arc))
+		{
+			obj = _objc_weak_load(obj);
+		}
 	}
-	for (int i=0 ; i<4 ; i++)
+	for (;;)
 	{
-		if (0 != ref->ref[i])
+		id old = *addr;
+		struct weak_ref_stripe *oldStripe = weak_ref_stripe_for(old);
+		struct weak_ref_stripe *newStripe = weak_ref_stripe_for(obj);
+		weak_ref_lock_two(oldStripe, newStripe);
+		// If another thread modified the weak reference before we acquired
+		// the lock, then we may have locked the wrong stripe.
+		if (*addr == old)
 		{
-			*ref->ref[i] = 0;
+			obj = storeWeakLocked(addr, old, obj, oldStripe, newStripe);
+			weak_ref_unlock_two(oldStripe, newStripe);
+			return obj;
 		}
+		weak_ref_unlock_two(oldStripe, newStripe);
 	}
-	if (shouldFree)
+}
+
+/**
+ * Zeroes the weak references to an object and removes them from its entry.
+ */
+static void zeroRefs(WeakRef *ref)
+{
+	uint32_t size;
+	id **refs = weak_ref_slots(ref, &size);
+	for (uint32_t i=0 ; i<size ; i++)
 	{
-		free(ref);
+		if (NULL != refs[i])
+		{
+			__atomic_store_n(refs[i], nil, __ATOMIC_SEQ_CST);
+		}
 	}
-	else
+	if (0 != ref->capacity)
 	{
-		memset(ref, 0, sizeof(WeakRef));
+		free(ref->refs);
 	}
+	ref->count = 0;
+	ref->capacity = 0;
+	memset(ref->ref, 0, sizeof(ref->ref));
 }
 
 void objc_delete_weak_refs(id obj)
 {
-	LOCK_FOR_SCOPE(&weakRefLock);
-	WeakRef *oldRef = weak_ref_table_get(weakRefs, obj);
+	struct weak_ref_stripe *stripe = weak_ref_stripe_for(obj);
+	LOCK_FOR_SCOPE(&stripe->lock);
+	WeakRef *oldRef = weak_ref_get(stripe, obj);
 	if (0 != oldRef)
 	{
-		zeroRefs(oldRef, NO);
+		zeroRefs(oldRef);
+		// Threads in objc_loadWeakRetained() may be calling out to load the
+		// object without the lock, and may need the lock to finish.  Wait for
+		// them without it.  The table may be resized while it is unlocked,
+		// so look up the entry again afterwards.
+		while (0 != oldRef->loading)
+		{
+			UNLOCK(&stripe->lock);
+			sched_yield();
+			LOCK(&stripe->lock);
+			oldRef = weak_ref_get(stripe, obj);
+		}
+		// Zero any references stored while the lock was released, then
+		// remove the entry.
+		zeroRefs(oldRef);
+		memset(oldRef, 0, sizeof(WeakRef));
+		// A thread in loadWeakRetainedFast() may have read the object from a
+		// weak reference before we zeroed it.  Wait for it to finish with the
+		// object before letting the caller free it.  Threads that register
+		// with the new epoch will see the zeroed references when they check
+		// the reference again.
+		unsigned int epoch =
+			__atomic_fetch_add(&stripe->epoch, 1, __ATOMIC_SEQ_CST) & 1;
+		while (0 != __atomic_load_n(&stripe->readers[epoch], __ATOMIC_SEQ_CST))
+		{
+			sched_yield();
+		}
+	}
+}
+
+/**
+ * Tries to load a weak reference to a fast-ARC object without acquiring a
+ * lock, by incrementing the reference count directly unless the object is
+ * already being deallocated.  Returns YES and sets *result if this succeeded,
+ * or NO if the caller must use the locked path.
+ */
+static inline BOOL loadWeakRetainedFast(id *addr, id *result)
+{
+	for (;;)
+	{
+		id obj = __atomic_load_n(addr, __ATOMIC_SEQ_CST);
+		if ((nil == obj) || isSmallObject(obj))
+		{
+			*result = obj;
+			return YES;
+		}
+		struct weak_ref_stripe *stripe = weak_ref_stripe_for(obj);
+		long *readers = &stripe->readers[
+			__atomic_load_n(&stripe->epoch, __ATOMIC_SEQ_CST) & 1];
+		__atomic_fetch_add(readers, 1, __ATOMIC_SEQ_CST);
+		// If the reference still points to the object now that we are
+		// registered as a reader, it can't be freed until we've finished.
+		if (__atomic_load_n(addr, __ATOMIC_SEQ_CST) != obj)
+		{
+			__atomic_fetch_sub(readers, 1, __ATOMIC_RELEASE);
+			continue;
+		}
+		Class cls = classForObject(obj);
+		if ((&_NSConcreteMallocBlock == cls) ||
+		    !objc_test_class_flag(cls, objc_class_flag_fast_arc))
+		{
+			__atomic_fetch_sub(readers, 1, __ATOMIC_RELEASE);
+			return NO;
+		}
+		if (!tryIncrementRefCount(obj))
+		{
+			obj = nil;
+		}
+		__atomic_fetch_sub(readers, 1, __ATOMIC_RELEASE);
+		*result = obj;
+		return YES;
 	}
 }
 
 id objc_loadWeakRetained(id* addr)
 {
-	LOCK_FOR_SCOPE(&weakRefLock);
-	id obj = *addr;
-	if (nil == obj) { return nil; }
-	Class cls = classForObject(obj);
-	if (&_NSConcreteMallocBlock == cls)
+	id obj;
+	if (loadWeakRetainedFast(addr, &obj))
 	{
-		obj = block_load_weak(obj);
+		return obj;
 	}
-	else if (objc_test_class_flag(cls, objc_class_flag_fast_arc))
+	for (;;)
 	{
-		if ((*(((intptr_t*)obj) - 1)) < 0)
+		// Lock the stripe for the object that the weak reference points to.
+		// While we hold it, the object can't be deallocated.
+		obj = *addr;
+		if (nil == obj) { return nil; }
+		struct weak_ref_stripe *stripe = weak_ref_stripe_for(obj);
+		LOCK(&stripe->lock);
+		if (*addr != obj)
 		{
-			return nil;
+			UNLOCK(&stripe->lock);
+			continue;
 		}
+		Class cls = classForObject(obj);
+		if (&_NSConcreteMallocBlock == cls)
+		{
+			obj = objc_retain(block_load_weak(obj));
+			UNLOCK(&stripe->lock);
+			return obj;
+		}
+		if (objc_test_class_flag(cls, objc_class_flag_fast_arc))
+		{
+			obj = isDeallocating(obj) ? nil : objc_retain(obj);
+			UNLOCK(&stripe->lock);
+			return obj;
+		}
+		// The _objc_weak_load() hook and -retain may use weak references to
+		// objects in other stripes, so call them without the lock.
+		// objc_delete_weak_refs() keeps the object's entry, and does not
+		// return, while we are registered in it.
+		weak_ref_get(stripe, obj)->loading++;
+		UNLOCK(&stripe->lock);
+		id retained = objc_retain(_objc_weak_load(obj));
+		LOCK(&stripe->lock);
+		weak_ref_get(stripe, obj)->loading--;
+		BOOL changed = (*addr != obj);
+		UNLOCK(&stripe->lock);
+		if (!changed)
+		{
+			return retained;
+		}
+		// The reference was zeroed or replaced while we were not holding the
+		// lock, so give back the reference and load it again.
+		objc_release(retained);
 	}
-	else
-	{
-		obj = _objc_weak_load(obj);
-	}
-	return objc_retain(obj);
 }
 
 id objc_loadWeak(id* object)
@@ -672,21 +1701,29 @@ void objc_moveWeak(id *dest, id *src)
 	// Don't retain or release.  While the weak ref lock is held, we know that
 	// the object can't be deallocated, so we just move the value and update
 	// the weak reference table entry to indicate the new address.
-	LOCK_FOR_SCOPE(&weakRefLock);
-	*dest = *src;
-	*src = nil;
-	WeakRef *oldRef = weak_ref_table_get(weakRefs, *dest);
-	while (NULL != oldRef)
+	struct weak_ref_stripe *stripe;
+	id obj;
+	for (;;)
 	{
-		for (int i=0 ; i<4 ; i++)
+		obj = *src;
+		if (nil == obj)
 		{
-			if (oldRef->ref[i] == src)
-			{
-				oldRef->ref[i] = dest;
-				return;
-			}
+			*dest = nil;
+			return;
 		}
+		stripe = weak_ref_stripe_for(obj);
+		LOCK(&stripe->lock);
+		if (*src == obj) { break; }
+		UNLOCK(&stripe->lock);
+	}
+	*dest = obj;
+	*src = nil;
+	WeakRef *oldRef = weak_ref_get(stripe, obj);
+	if ((NULL != oldRef) && weak_ref_entry_remove(oldRef, src))
+	{
+		weak_ref_entry_add(oldRef, dest);
 	}
+	UNLOCK(&stripe->lock);
 }
 
 void objc_destroyWeak(id* obj)
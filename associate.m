@@ -1,7 +1,13 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#ifdef WIN32
+#include <malloc.h>
+#else
+#include <unistd.h>
+#endif
 #include "objc/runtime.h"
 #include "objc/objc-arc.h"
 #include "nsobject.h"
@@ -37,17 +43,65 @@ struct reference
 #define REFERENCE_LIST_SIZE 10
 
 /**
- * Linked list of references associated with an object.  We assume that there
- * won't be very many, so we don't bother with a proper hash table, and just
- * iterate over a list.
+ * Open-addressed hash table mapping keys to references, used once an object
+ * has more references than fit in one reference list.
+ */
+struct reference_index
+{
+	/**
+	 * The number of slots, minus one.  The number of slots is a power of two.
+	 */
+	uint32_t mask;
+	/**
+	 * The number of bits in the slot index.
+	 */
+	uint32_t bits;
+	/**
+	 * The index that this one replaced.  Lookups may still be using it, so it
+	 * is only freed with the reference list.
+	 */
+	struct reference_index *previous;
+	/**
+	 * The slots.  References are never removed from the index, except when all
+	 * of an object's references are cleaned up.
+	 */
+	struct reference *slots[];
+};
+
+/**
+ * Linked list of references associated with an object.  Most objects have only
+ * a few, which are found by iterating over the first list.  Once there are more
+ * than fit in one list, they are also added to a hash table.
  */
 struct reference_list
 {
 	/**
 	 * Next group of references.  This is only ever used if we have more than
-	 * 10 references associated with an object, which seems highly unlikely.
+	 * 10 references associated with an object.
 	 */
 	struct reference_list *next;
+	/**
+	 * The last list in the chain that contains references.  Only set for the
+	 * first reference list in a chain, and NULL until a second list is used.
+	 */
+	struct reference_list *tail;
+	/**
+	 * The number of references in the chain.  Only set for the first
+	 * reference list in a chain.  References are used in order, so this is
+	 * also the position of the next free one.
+	 */
+	unsigned int count;
+	/**
+	 * Set for the first reference list of an object's hidden class if none of
+	 * its superclasses have associated references, so that lookups that miss
+	 * in this list do not need to search them.
+	 */
+	BOOL noInheritedReferences;
+	/**
+	 * Hash table of all references in the chain, or NULL if there are too few
+	 * to need one.  Only set for the first reference list in a chain.
+	 */
+	struct reference_index *index;
 	/**
 	 * Mutex.  Only set for the first reference list in a chain.  Used for
 	 * @syncronize().
@@ -73,10 +127,86 @@ static BOOL isAtomic(uintptr_t policy)
 	return (policy & OBJC_ASSOCIATION_ATOMIC) == OBJC_ASSOCIATION_ATOMIC;
 }
 
+static inline uint32_t hashKey(struct reference_index *index, void *key)
+{
+	uint64_t k = (uintptr_t)key;
+	uint32_t h = (uint32_t)(k ^ (k >> 32));
+	// Fibonacci hashing: the high bits of the product depend on all of the
+	// bits of the key.
+	return (h * 2654435761U) >> (32 - index->bits);
+}
+
+static struct reference* findIndexedReference(struct reference_index *index,
+                                              void *key)
+{
+	for (uint32_t i=hashKey(index, key) ; ; i=(i+1) & index->mask)
+	{
+		struct reference *r = __atomic_load_n(&index->slots[i], __ATOMIC_ACQUIRE);
+		if ((NULL == r) || (r->key == key))
+		{
+			return r;
+		}
+	}
+}
+
+static void insertIndexedReference(struct reference_index *index,
+                                   struct reference *r)
+{
+	for (uint32_t i=hashKey(index, r->key) ; ; i=(i+1) & index->mask)
+	{
+		if (NULL == index->slots[i])
+		{
+			__atomic_store_n(&index->slots[i], r, __ATOMIC_RELEASE);
+			return;
+		}
+	}
+}
+
+/**
+ * Adds a new reference to the index, building a larger index if the current
+ * one is more than half full.  Must be called with the list locked.
+ */
+static void indexReference(struct reference_list *list, struct reference *r)
+{
+	struct reference_index *index = list->index;
+	if ((NULL != index) && (list->count * 2 <= index->mask + 1))
+	{
+		insertIndexedReference(index, r);
+		return;
+	}
+	uint32_t bits = 5;
+	while ((1U << bits) < list->count * 4)
+	{
+		bits++;
+	}
+	struct reference_index *newIndex = gc->malloc(sizeof(struct reference_index) +
+			sizeof(struct reference*) * (1U << bits));
+	newIndex->mask = (1U << bits) - 1;
+	newIndex->bits = bits;
+	newIndex->previous = index;
+	unsigned int remaining = list->count;
+	for (struct reference_list *l=list ; (NULL != l) && (remaining > 0) ; l=l->next)
+	{
+		for (int i=0 ; (i<REFERENCE_LIST_SIZE) && (remaining > 0) ; i++, remaining--)
+		{
+			if (0 != l->list[i].key)
+			{
+				insertIndexedReference(newIndex, &l->list[i]);
+			}
+		}
+	}
+	__atomic_store_n(&list->index, newIndex, __ATOMIC_RELEASE);
+}
+
 static struct reference* findReference(struct reference_list *list, void *key)
 {
 	if (NULL == list) { return NULL; }
 
+	struct reference_index *index = __atomic_load_n(&list->index, __ATOMIC_ACQUIRE);
+	if (NULL != index)
+	{
+		return findIndexedReference(index, key);
+	}
 	for (int i=0 ; i<REFERENCE_LIST_SIZE ; i++)
 	{
 		if (list->list[i].key == key)
@@ -86,6 +216,65 @@ static struct reference* findReference(struct reference_list *list, void *key)
 	}
 	return NULL;
 }
+
+/**
+ * Uses the next free reference in the chain for a key.  Must be called with
+ * the list locked.
+ */
+static struct reference* addReference(struct reference_list *list, void *key)
+{
+	struct reference_list *l = (NULL == list->tail) ? list : list->tail;
+	unsigned int slot = list->count % REFERENCE_LIST_SIZE;
+	if ((0 == slot) && (0 != list->count))
+	{
+		// Lists are kept when references are cleaned up, so there may already
+		// be an empty one.
+		if (NULL == l->next)
+		{
+			l->next = gc->malloc(sizeof(struct reference_list));
+		}
+		l = l->next;
+		list->tail = l;
+	}
+	struct reference *r = &l->list[slot];
+	r->key = key;
+	list->count++;
+	if ((NULL != list->index) || (list->count > REFERENCE_LIST_SIZE))
+	{
+		indexReference(list, r);
+	}
+	return r;
+}
+
+/**
+ * Forgets all of the keys in the index, before the references are cleaned up.
+ */
+static void resetReferenceList(struct reference_list *list)
+{
+	if (NULL == list) { return; }
+	volatile int *lock = lock_for_pointer(list);
+	lock_spinlock(lock);
+	if (NULL != list->index)
+	{
+		for (uint32_t i=0 ; i<=list->index->mask ; i++)
+		{
+			__atomic_store_n(&list->index->slots[i], NULL, __ATOMIC_RELAXED);
+		}
+	}
+	list->count = 0;
+	list->tail = NULL;
+	unlock_spinlock(lock);
+}
+
+static void freeReferenceIndex(struct reference_index *index)
+{
+	while (NULL != index)
+	{
+		struct reference_index *previous = index->previous;
+		gc->free(index);
+		index = previous;
+	}
+}
 static void cleanupReferenceList(struct reference_list *list)
 {
 	if (NULL == list) { return; }
@@ -145,18 +334,7 @@ static void setReference(struct reference_list *list,
 	// have to install a new one
 	if (NULL == r)
 	{
-		// Search for an unused slot
-		r = findReference(list, 0);
-		if (NULL == r)
-		{
-			struct reference_list *l = list;
-
-			while (NULL != l->next) { l = l->next; }
-
-			l->next = gc->malloc(sizeof(struct reference_list));
-			r = &l->next->list[0];
-		}
-		r->key = key;
+		r = addReference(list, key);
 	}
 	unlock_spinlock(lock);
 	// Now we only need to lock if the old or new property is atomic
@@ -243,8 +421,10 @@ static void deallocHiddenClass(id obj, SEL _cmd)
 	// Free the hidden
 	struct reference_list *list = object_getIndexedIvars(hiddenClass);
 	DESTROY_LOCK(&list->lock);
+	resetReferenceList(list);
 	cleanupReferenceList(list);
 	freeReferenceList(list->next);
+	freeReferenceIndex(list->index);
 	free_dtable(hiddenClass->dtable);
 	// Free the class
 	free(hiddenClass);
@@ -311,10 +491,12 @@ id objc_getAssociatedObject(id object, void *key)
 	{
 		return r->object;
 	}
-	if (class_isMetaClass(object->isa))
+	if (class_isMetaClass(object->isa) || list->noInheritedReferences)
 	{
 		return nil;
 	}
+	struct reference_list *objectList = list;
+	BOOL foundInherited = NO;
 	Class cls = object->isa;
 	while (Nil != cls)
 	{
@@ -328,6 +510,7 @@ id objc_getAssociatedObject(id object, void *key)
 			struct reference_list *next_list = object_getIndexedIvars(cls);
 			if (list != next_list)
 			{
+				foundInherited = YES;
 				list = next_list;
 				struct reference *r = findReference(list, key);
 				if (NULL != r)
@@ -338,6 +521,12 @@ id objc_getAssociatedObject(id object, void *key)
 			cls = class_getSuperclass(cls);
 		}
 	}
+	// Superclasses never become hidden classes, so if there are none now then
+	// later lookups can skip the search.
+	if (!foundInherited)
+	{
+		objectList->noInheritedReferences = YES;
+	}
 	return nil;
 }
 
@@ -345,7 +534,9 @@ id objc_getAssociatedObject(id object, void *key)
 void objc_removeAssociatedObjects(id object)
 {
 	if (isSmallObject(object)) { return; }
-	cleanupReferenceList(referenceListForObject(object, NO));
+	struct reference_list *list = referenceListForObject(object, NO);
+	resetReferenceList(list);
+	cleanupReferenceList(list);
 }
 
 PRIVATE void *gc_typeForClass(Class cls)
@@ -359,9 +550,333 @@ PRIVATE void gc_setTypeForClass(Class cls, void *type)
 	list->gc_type = type;
 }
 
+////////////////////////////////////////////////////////////////////////////////
+// Monitors for @synchronized
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Number of times that a thread initially spins waiting for a monitor before
+ * sleeping.  This adapts to how long each monitor is usually held.
+ */
+#define SYNC_SPIN_INITIAL 128
+#define SYNC_SPIN_MIN 16
+#define SYNC_SPIN_MAX 4096
+
+/**
+ * State used to sleep while waiting for a monitor.  Only allocated for
+ * monitors that have been contended for longer than a thread will spin.
+ */
+struct sync_wait
+{
+#ifndef WIN32
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+#endif
+	/** Number of threads sleeping on the condition variable. */
+	unsigned int waiting;
+};
+
+/**
+ * The monitor for one object.  Monitors are not freed, but are reused for
+ * other objects once nothing is using them.
+ */
+struct sync_monitor
+{
+	/** The object that this monitor locks.  Protected by the stripe lock. */
+	id object;
+	/** The thread holding the monitor, or NULL.  Acquired with CAS. */
+	void *owner;
+	/** Number of times the owner has entered the monitor. */
+	unsigned int recursion;
+	/**
+	 * Number of entries, by the owner and by threads waiting for it, that
+	 * have not exited.  Protected by the stripe lock.
+	 */
+	unsigned int users;
+	/** Number of times to spin before sleeping. */
+	int spinLimit;
+	/** The sleeping state, or NULL if the monitor has not been contended. */
+	struct sync_wait *wait;
+	struct sync_monitor *next;
+};
+
+/**
+ * A set of monitors for objects whose addresses hash to the same value.  The
+ * stripe lock is only held while finding the monitor, not while the object is
+ * locked.
+ */
+struct sync_stripe
+{
+	struct sync_monitor *monitors;
+	int lock;
+} __attribute__((aligned(64)));
+
+static struct sync_stripe *syncStripes;
+static unsigned int syncStripeShift;
+#if defined(COMPILER_TLS) && !defined(WIN32)
+/** The address of this identifies the calling thread. */
+static __thread char syncThread;
+#elif !defined(WIN32)
+/**
+ * Key for a per-thread allocation whose address identifies the thread.
+ */
+static pthread_key_t syncThreadKey;
+#endif
+
+PRIVATE void init_sync(void)
+{
+#ifdef WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	long cpus = info.dwNumberOfProcessors;
+#else
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	// Enough stripes that threads on different cores rarely share one.
+	unsigned int bits = 4;
+	while (((1L << bits) < cpus * 4) && (bits < 12))
+	{
+		bits++;
+	}
+	// Align the table so that each stripe has its own cache line.
+	size_t size = (1 << bits) * sizeof(struct sync_stripe);
+#ifdef WIN32
+	syncStripes = _aligned_malloc(size, 64);
+#else
+	if (0 != posix_memalign((void**)&syncStripes, 64, size))
+	{
+		syncStripes = NULL;
+	}
+#endif
+	memset(syncStripes, 0, size);
+	syncStripeShift = 32 - bits;
+#if !defined(WIN32) && !defined(COMPILER_TLS)
+	pthread_key_create(&syncThreadKey, free);
+#endif
+}
+
+/**
+ * Returns a non-NULL value that identifies the calling thread, for use as the
+ * owner of a monitor.
+ */
+static inline void *currentThread(void)
+{
+#ifdef WIN32
+	return (void*)(uintptr_t)GetCurrentThreadId();
+#elif defined(COMPILER_TLS)
+	return &syncThread;
+#else
+	void *self = pthread_getspecific(syncThreadKey);
+	if (UNLIKELY(NULL == self))
+	{
+		self = malloc(1);
+		pthread_setspecific(syncThreadKey, self);
+	}
+	return self;
+#endif
+}
+
+static inline struct sync_stripe *stripeForObject(id obj)
+{
+	uint32_t hash = (uint32_t)((uintptr_t)obj >> 4) * 2654435761U;
+	return &syncStripes[hash >> syncStripeShift];
+}
+
+static inline void cpuRelax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+static inline BOOL tryAcquireMonitor(struct sync_monitor *m, void *self)
+{
+	void *expected = NULL;
+	return __atomic_compare_exchange_n(&m->owner, &expected, self, 0,
+	                                   __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+/**
+ * Waits for a contended monitor.  Spins for a while, in case the owner is
+ * about to release it, and then sleeps.
+ */
+static void acquireMonitorSlow(struct sync_stripe *stripe,
+                               struct sync_monitor *m,
+                               void *self)
+{
+	int limit = __atomic_load_n(&m->spinLimit, __ATOMIC_RELAXED);
+	for (int i=0 ; i<limit ; i++)
+	{
+		cpuRelax();
+		if ((NULL == __atomic_load_n(&m->owner, __ATOMIC_RELAXED)) &&
+		    tryAcquireMonitor(m, self))
+		{
+			if (limit < SYNC_SPIN_MAX)
+			{
+				__atomic_store_n(&m->spinLimit, limit * 2, __ATOMIC_RELAXED);
+			}
+			return;
+		}
+	}
+	if (limit > SYNC_SPIN_MIN)
+	{
+		__atomic_store_n(&m->spinLimit, limit / 2, __ATOMIC_RELAXED);
+	}
+	struct sync_wait *w = __atomic_load_n(&m->wait, __ATOMIC_SEQ_CST);
+	if (NULL == w)
+	{
+		lock_spinlock(&stripe->lock);
+		w = m->wait;
+		if (NULL == w)
+		{
+			w = calloc(1, sizeof(struct sync_wait));
+#ifndef WIN32
+			pthread_mutex_init(&w->lock, NULL);
+			pthread_cond_init(&w->cond, NULL);
+#endif
+			__atomic_store_n(&m->wait, w, __ATOMIC_SEQ_CST);
+		}
+		unlock_spinlock(&stripe->lock);
+	}
+#ifdef WIN32
+	while (!tryAcquireMonitor(m, self))
+	{
+		Sleep(0);
+	}
+#else
+	// The owner checks for sleeping threads after releasing the monitor, with
+	// the mutex held, so it can't be released between our failed attempt to
+	// acquire it and waiting on the condition variable.
+	pthread_mutex_lock(&w->lock);
+	w->waiting++;
+	while (!tryAcquireMonitor(m, self))
+	{
+		pthread_cond_wait(&w->cond, &w->lock);
+	}
+	w->waiting--;
+	pthread_mutex_unlock(&w->lock);
+#endif
+}
+
+static int monitorEnter(id obj)
+{
+	struct sync_stripe *stripe = stripeForObject(obj);
+	void *self = currentThread();
+	lock_spinlock(&stripe->lock);
+	struct sync_monitor *m = stripe->monitors;
+	struct sync_monitor *unused = NULL;
+	for (; NULL != m ; m = m->next)
+	{
+		if (m->object == obj) { break; }
+		if ((NULL == unused) && (0 == m->users) &&
+		    (NULL == __atomic_load_n(&m->owner, __ATOMIC_SEQ_CST)))
+		{
+			unused = m;
+		}
+	}
+	if (NULL == m)
+	{
+		m = unused;
+		if (NULL == m)
+		{
+			m = calloc(1, sizeof(struct sync_monitor));
+			m->spinLimit = SYNC_SPIN_INITIAL;
+			m->next = stripe->monitors;
+			stripe->monitors = m;
+		}
+		m->object = obj;
+	}
+	m->users++;
+	unlock_spinlock(&stripe->lock);
+	if (__atomic_load_n(&m->owner, __ATOMIC_RELAXED) == self)
+	{
+		m->recursion++;
+		return 0;
+	}
+	if (!tryAcquireMonitor(m, self))
+	{
+		acquireMonitorSlow(stripe, m, self);
+	}
+	m->recursion = 1;
+	return 0;
+}
+
+static int monitorExit(id obj)
+{
+	struct sync_stripe *stripe = stripeForObject(obj);
+	void *self = currentThread();
+	lock_spinlock(&stripe->lock);
+	struct sync_monitor *m = stripe->monitors;
+	while ((NULL != m) && (m->object != obj))
+	{
+		m = m->next;
+	}
+	if ((NULL == m) || (__atomic_load_n(&m->owner, __ATOMIC_RELAXED) != self))
+	{
+		unlock_spinlock(&stripe->lock);
+		return 1;
+	}
+	// The monitor can't be reused while we still own it.
+	m->users--;
+	if (--m->recursion > 0)
+	{
+		unlock_spinlock(&stripe->lock);
+		return 0;
+	}
+	unlock_spinlock(&stripe->lock);
+	__atomic_store_n(&m->owner, NULL, __ATOMIC_SEQ_CST);
+	// If another thread is sleeping, then it inflated the monitor before it
+	// last tried to acquire it, so we will see the wait state.  The wait state
+	// is never freed, so it is safe to use even if the monitor has already
+	// been reused.
+#ifndef WIN32
+	struct sync_wait *w = __atomic_load_n(&m->wait, __ATOMIC_SEQ_CST);
+	if (NULL != w)
+	{
+		pthread_mutex_lock(&w->lock);
+		if (w->waiting > 0)
+		{
+			pthread_cond_signal(&w->cond);
+		}
+		pthread_mutex_unlock(&w->lock);
+	}
+#endif
+	return 0;
+}
+
+/**
+ * Detaches the monitor, if any, from an object that is being deallocated, so
+ * that it can be reused for another object.
+ */
+PRIVATE void release_monitor_for_object(id obj)
+{
+	if (NULL == syncStripes) { return; }
+	struct sync_stripe *stripe = stripeForObject(obj);
+	if (NULL == __atomic_load_n(&stripe->monitors, __ATOMIC_RELAXED))
+	{
+		return;
+	}
+	lock_spinlock(&stripe->lock);
+	for (struct sync_monitor *m=stripe->monitors ; NULL != m ; m=m->next)
+	{
+		if ((m->object == obj) && (0 == m->users))
+		{
+			m->object = nil;
+			break;
+		}
+	}
+	unlock_spinlock(&stripe->lock);
+}
+
 int objc_sync_enter(id object)
 {
 	if (isSmallObject(object)) { return 0; }
+	// Classes have a reference list already, so use its lock.  Other objects
+	// use a monitor, so that they do not need a hidden class.
+	if (!class_isMetaClass(object->isa))
+	{
+		return monitorEnter(object);
+	}
 	struct reference_list *list = referenceListForObject(object, YES);
 	LOCK(&list->lock);
 	return 0;
@@ -370,6 +885,10 @@ int objc_sync_enter(id object)
 int objc_sync_exit(id object)
 {
 	if (isSmallObject(object)) { return 0; }
+	if (!class_isMetaClass(object->isa))
+	{
+		return monitorExit(object);
+	}
 	struct reference_list *list = referenceListForObject(object, NO);
 	if (NULL != list)
 	{
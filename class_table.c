@@ -78,6 +78,7 @@ static int class_hash(const Class class)
 #define MAP_TABLE_COMPARE_FUNCTION class_compare
 #define MAP_TABLE_HASH_KEY string_hash
 #define MAP_TABLE_HASH_VALUE class_hash
+#define MAP_TABLE_CONCURRENT
 // This defines the maximum number of classes that the runtime supports.
 /*
 #define MAP_TABLE_STATIC_SIZE 2048
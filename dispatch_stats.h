@@ -0,0 +1,73 @@
+#ifndef __OBJC_DISPATCH_STATS_H_INCLUDED
+#define __OBJC_DISPATCH_STATS_H_INCLUDED
+/**
+ * Optional counters for the message dispatch slow paths, and for autoreleased
+ * return values that could not be handed straight over.  When the runtime is
+ * built with DISPATCH_STATS, each thread counts the events below in its own
+ * set of counters, so counting never contends.  The counters for all threads
+ * are summed by objc_getDispatchStats_np().
+ */
+#include "visibility.h"
+#include <stdint.h>
+
+#ifdef DISPATCH_STATS
+#ifndef COMPILER_TLS
+#	error Dispatch statistics require COMPILER_TLS
+#endif
+enum dispatch_stat
+{
+	/** Lookups that missed in the dispatch table. */
+	DISPATCH_STAT_SLOW_LOOKUP,
+	/** Methods found only by their untyped selector. */
+	DISPATCH_STAT_UNTYPED_FALLBACK,
+	/** Receivers replaced by the objc_proxy_lookup() hook. */
+	DISPATCH_STAT_PROXY_LOOKUP,
+	/** Calls to the __objc_msg_forward3() hook. */
+	DISPATCH_STAT_FORWARD,
+	/** Lookups that had to wait for +initialize to finish. */
+	DISPATCH_STAT_INITIALIZE_WAIT,
+	/** Selectors registered lazily when first sent. */
+	DISPATCH_STAT_LAZY_SELECTOR,
+	/** Return values handed to the caller without being autoreleased. */
+	DISPATCH_STAT_RETURN_ELIDED,
+	/** Return values that were put in the autorelease pool. */
+	DISPATCH_STAT_RETURN_AUTORELEASED,
+	DISPATCH_STAT_COUNT
+};
+
+struct dispatch_stats
+{
+	uint64_t counters[DISPATCH_STAT_COUNT];
+	/** The next thread's counters.  Counters are never freed. */
+	struct dispatch_stats *next;
+};
+
+extern __thread struct dispatch_stats *dispatch_thread_stats;
+
+/**
+ * Allocates the counters for the calling thread.
+ */
+struct dispatch_stats *dispatch_stats_register_thread(void);
+
+static inline void dispatch_stat_increment(enum dispatch_stat stat)
+{
+	struct dispatch_stats *stats = dispatch_thread_stats;
+	if (UNLIKELY(NULL == stats))
+	{
+		stats = dispatch_stats_register_thread();
+	}
+	// Only this thread writes the counter, but others may read it.
+	__atomic_store_n(&stats->counters[stat], stats->counters[stat] + 1,
+	                 __ATOMIC_RELAXED);
+}
+
+/**
+ * Prints the dispatch counters.  Called when LIBOBJC_MEMORY_PROFILE is set.
+ */
+void log_dispatch_stats(void);
+
+#	define DISPATCH_STAT(x) dispatch_stat_increment(DISPATCH_STAT_ ## x)
+#else
+#	define DISPATCH_STAT(x) do {} while(0)
+#endif
+#endif // __OBJC_DISPATCH_STATS_H_INCLUDED
@@ -415,6 +415,89 @@ static BOOL installMethodInDtable(Class class,
 	return YES;
 }
 
+#ifdef DTABLE_CACHE
+PRIVATE void dtable_cache_insert(dtable_t dtable, uint32_t uid,
+                                 struct objc_slot *slot)
+{
+	struct dtable_cache *cache = dtable->cache;
+	if (NULL == cache)
+	{
+		cache = calloc(1, sizeof(struct dtable_cache));
+		if (!__sync_bool_compare_and_swap(&dtable->cache, NULL, cache))
+		{
+			free(cache);
+			cache = dtable->cache;
+		}
+	}
+	for (unsigned i=0 ; i<DTABLE_CACHE_PROBES ; i++)
+	{
+		struct dtable_cache_line *line =
+			&cache->lines[(uid + i) & (DTABLE_CACHE_SIZE - 1)];
+		// Claim an empty line for this selector.  Selector index 0 is never
+		// used, so it marks empty lines.
+		if ((line->idx == uid) ||
+		    ((0 == line->idx) && __sync_bool_compare_and_swap(&line->idx, 0, uid)))
+		{
+			// Slot versions are never 0, so a reader that sees the new slot
+			// but the old version (or vice versa) will just miss.
+			line->slot = slot;
+			__atomic_store_n(&line->version, slot->version, __ATOMIC_RELEASE);
+			return;
+		}
+	}
+	// All of the lines that this selector can use are taken by other
+	// selectors.  Leave it in the sparse array.
+}
+
+PRIVATE void dtable_cache_flush(dtable_t dtable)
+{
+	struct dtable_cache *cache = dtable->cache;
+	if (NULL == cache) { return; }
+	// Other threads may be reading from the cache, so we can't reassign lines
+	// to other selectors.  Instead, refresh any line whose slot has been
+	// replaced from the dtable.
+	for (unsigned i=0 ; i<DTABLE_CACHE_SIZE ; i++)
+	{
+		struct dtable_cache_line *line = &cache->lines[i];
+		if ((0 == line->idx) || (NULL == line->slot)) { continue; }
+		struct objc_slot *slot = SparseArrayLookup(dtable, line->idx);
+		if ((slot != line->slot) || (slot->version != line->version))
+		{
+			line->slot = slot;
+			__atomic_store_n(&line->version, (NULL == slot) ? 0 : slot->version,
+					__ATOMIC_RELEASE);
+		}
+	}
+}
+#endif
+
+#ifdef DENSE_SELECTOR_INDICES
+PRIVATE void objc_resize_dtables(uint32_t newSize);
+/**
+ * Makes sure that the dtables are large enough for all of the methods in a
+ * method list and, optionally, in the lists that follow it.  The dtables are
+ * normally only as large as the dense selector range.  They only grow when a
+ * sparse selector is used in a method.
+ */
+static void resize_dtables_for_methods(struct objc_method_list *list,
+                                       BOOL recurse)
+{
+	uint32_t max = 0;
+	for ( ; NULL != list ; list = recurse ? list->next : NULL)
+	{
+		for (unsigned i=0 ; i<list->count ; i++)
+		{
+			SEL sel = list->methods[i].selector;
+			uint32_t idx = sel->index;
+			if (idx > max) { max = idx; }
+			idx = get_untyped_idx(sel);
+			if (idx > max) { max = idx; }
+		}
+	}
+	objc_resize_dtables(max + 1);
+}
+#endif
+
 static void installMethodsInClass(Class cls,
                                   Class owner,
                                   SparseArray *methods,
@@ -433,6 +516,9 @@ static void installMethodsInClass(Class cls,
 			SparseArrayInsert(methods, idx, 0);
 		}
 	}
+#ifdef DTABLE_CACHE
+	dtable_cache_flush(dtable);
+#endif
 }
 
 static void mergeMethodsFromSuperclass(Class super, Class cls, SparseArray *methods)
@@ -465,6 +551,9 @@ PRIVATE void objc_update_dtable_for_class(Class cls)
 
 	LOCK_RUNTIME_FOR_SCOPE();
 
+#ifdef DENSE_SELECTOR_INDICES
+	resize_dtables_for_methods((void*)cls->methods, YES);
+#endif
 	SparseArray *methods = SparseArrayNewWithDepth(dtable_depth);
 	collectMethodsForMethodListToSparseArray((void*)cls->methods, methods, YES);
 	installMethodsInClass(cls, cls, methods, YES);
@@ -482,6 +571,9 @@ PRIVATE void add_method_list_to_class(Class cls,
 
 	LOCK_RUNTIME_FOR_SCOPE();
 
+#ifdef DENSE_SELECTOR_INDICES
+	resize_dtables_for_methods(list, NO);
+#endif
 	SparseArray *methods = SparseArrayNewWithDepth(dtable_depth);
 	collectMethodsForMethodListToSparseArray(list, methods, NO);
 	installMethodsInClass(cls, cls, methods, YES);
@@ -502,6 +594,9 @@ static dtable_t create_dtable_for_class(Class class, dtable_t root_dtable)
 	// waiting on the lock.
 	if (classHasDtable(class)) { return dtable_for_class(class); }
 
+#ifdef DENSE_SELECTOR_INDICES
+	resize_dtables_for_methods((void*)class->methods, YES);
+#endif
 	Class super = class_getSuperclass(class);
 	dtable_t dtable;
 
@@ -549,6 +644,19 @@ static dtable_t create_dtable_for_class(Class class, dtable_t root_dtable)
 
 Class class_table_next(void **e);
 
+/**
+ * Adds levels to the top of a dtable that is oldDepth bits deep until it is
+ * dtable_depth bits deep.  SparseArrayExpandingArray() adds one level each
+ * time that it is called.
+ */
+static void expandDtable(SparseArray *dtable, uint32_t oldDepth)
+{
+	for (uint32_t depth=oldDepth+8 ; depth<=dtable_depth ; depth+=8)
+	{
+		SparseArrayExpandingArray(dtable, depth);
+	}
+}
+
 PRIVATE void objc_resize_dtables(uint32_t newSize)
 {
 	// If dtables already have enough space to store all registered selectors, do nothing
@@ -558,11 +666,20 @@ PRIVATE void objc_resize_dtables(uint32_t newSize)
 
 	if (1<<dtable_depth > newSize) { return; }
 
+	uint32_t oldDepth = dtable_depth;
+#ifdef DENSE_SELECTOR_INDICES
+	// Sparse selectors may need more than one extra level.
+	while (((uint64_t)1<<dtable_depth) <= newSize)
+	{
+		dtable_depth += 8;
+	}
+#else
 	dtable_depth += 8;
+#endif
 
 	uint32_t oldMask = uninstalled_dtable->mask;
 
-	SparseArrayExpandingArray(uninstalled_dtable, dtable_depth);
+	expandDtable(uninstalled_dtable, oldDepth);
 	// Resize all existing dtables
 	void *e = NULL;
 	struct objc_class *next;
@@ -572,12 +689,45 @@ PRIVATE void objc_resize_dtables(uint32_t newSize)
 			NULL != next->dtable &&
 			((SparseArray*)next->dtable)->mask == oldMask)
 		{
-			SparseArrayExpandingArray((void*)next->dtable, dtable_depth);
-			SparseArrayExpandingArray((void*)next->isa->dtable, dtable_depth);
+			expandDtable((void*)next->dtable, oldDepth);
+			expandDtable((void*)next->isa->dtable, oldDepth);
 		}
 	}
 }
 
+PRIVATE void log_dtable_memory_usage(void)
+{
+	int dtables = 0;
+	int size = 0;
+#ifdef DTABLE_CACHE
+	int caches = 0;
+#endif
+	void *e = NULL;
+	struct objc_class *next;
+	while ((next = class_table_next(&e)))
+	{
+		Class classes[2] = { next, next->isa };
+		for (int i=0 ; i<2 ; i++)
+		{
+			if (!classHasInstalledDtable(classes[i])) { continue; }
+			dtables++;
+			size += SparseArraySize(classes[i]->dtable);
+#ifdef DTABLE_CACHE
+			if (NULL != ((SparseArray*)classes[i]->dtable)->cache)
+			{
+				caches++;
+			}
+#endif
+		}
+	}
+	fprintf(stderr, "%d bytes in %d dtables (shared nodes counted once per dtable).\n",
+	        size, dtables);
+#ifdef DTABLE_CACHE
+	fprintf(stderr, "%d bytes in %d method caches.\n",
+	        (int)(caches * sizeof(struct dtable_cache)), caches);
+#endif
+}
+
 PRIVATE dtable_t objc_copy_dtable_for_class(dtable_t old, Class cls)
 {
 	return SparseArrayCopy(old);
@@ -3,15 +3,109 @@
 #include "sarray2.h"
 #include "objc/slot.h"
 #include "visibility.h"
+#include "dispatch_stats.h"
 #include <stdint.h>
 #include <stdio.h>
 
 #ifdef __OBJC_LOW_MEMORY__
 typedef struct objc_dtable* dtable_t;
 struct objc_slot* objc_dtable_lookup(dtable_t dtable, uint32_t uid);
+#	define objc_dtable_lookup_cached objc_dtable_lookup
 #else
 typedef SparseArray* dtable_t;
 #	define objc_dtable_lookup SparseArrayLookup
+#	ifdef DTABLE_CACHE
+/**
+ * Number of lines in the per-class method cache.  Must be a power of two.  The
+ * x86-64 objc_msgSend() implementation depends on this value.
+ */
+#		define DTABLE_CACHE_SIZE 64
+/**
+ * Number of consecutive lines that may hold a given selector.  Lookups stop
+ * at the first empty line.
+ */
+#		define DTABLE_CACHE_PROBES 4
+/**
+ * A line in a per-class method cache.  Once a line has been claimed for a
+ * selector, it is only ever updated to hold newer slots for the same selector,
+ * so a reader racing with an update will only ever see a slot for the selector
+ * that it is looking up.  The version is the version of the slot when it was
+ * cached and is used to detect slots that have been invalidated.
+ */
+struct dtable_cache_line
+{
+	uint32_t idx;
+	int version;
+	struct objc_slot *slot;
+};
+/**
+ * Flat, open-addressed method cache, keyed on selector index.  This is
+ * allocated lazily for the root node of a dtable and is checked before the
+ * sparse array.
+ */
+struct dtable_cache
+{
+	struct dtable_cache_line lines[DTABLE_CACHE_SIZE];
+};
+
+/**
+ * Looks up a selector in the method cache for a dtable.  Returns NULL on a
+ * cache miss.
+ */
+static inline struct objc_slot *dtable_cache_lookup(dtable_t dtable, uint32_t uid)
+{
+	struct dtable_cache *cache = dtable->cache;
+	if (NULL == cache) { return NULL; }
+	for (unsigned i=0 ; i<DTABLE_CACHE_PROBES ; i++)
+	{
+		struct dtable_cache_line *line =
+			&cache->lines[(uid + i) & (DTABLE_CACHE_SIZE - 1)];
+		uint32_t idx = __atomic_load_n(&line->idx, __ATOMIC_ACQUIRE);
+		if (idx == uid)
+		{
+			struct objc_slot *slot = line->slot;
+			if ((NULL != slot) && (slot->version == line->version))
+			{
+				return slot;
+			}
+			return NULL;
+		}
+		if (0 == idx) { break; }
+	}
+	return NULL;
+}
+/**
+ * Adds a slot to the method cache for a dtable.
+ */
+void dtable_cache_insert(dtable_t dtable, uint32_t uid, struct objc_slot *slot);
+/**
+ * Removes stale entries from the method cache for a dtable.  Must be called
+ * with the runtime lock held, after modifying the dtable.
+ */
+void dtable_cache_flush(dtable_t dtable);
+
+/**
+ * Looks up a slot for message dispatch.  This checks the method cache first
+ * and falls back to the sparse array, filling the cache on a hit.
+ */
+static inline struct objc_slot *objc_dtable_lookup_cached(dtable_t dtable,
+                                                          uint32_t uid)
+{
+	struct objc_slot *slot = dtable_cache_lookup(dtable, uid);
+	if (LIKELY(NULL != slot))
+	{
+		return slot;
+	}
+	slot = SparseArrayLookup(dtable, uid);
+	if (NULL != slot)
+	{
+		dtable_cache_insert(dtable, uid, slot);
+	}
+	return slot;
+}
+#	else
+#		define objc_dtable_lookup_cached objc_dtable_lookup
+#	endif
 #endif
 
 /**
@@ -95,6 +189,7 @@ static inline dtable_t dtable_for_class(Class cls)
 		// this if the dtable is the uninstalled dtable, because that means
 		// +initialize has not yet been sent, so we can wait until something
 		// triggers it before needing any synchronisation.
+		DISPATCH_STAT(INITIALIZE_WAIT);
 		objc_sync_enter((id)cls);
 		objc_sync_exit((id)cls);
 	}
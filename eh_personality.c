@@ -524,10 +524,10 @@ struct thread_data
 	struct objc_exception *caughtExceptions;
 };
 
-// IF we don't have pthreads, then we fall back to using a per-thread
-// structure.  This will leak memory if we terminate any threads with
-// exceptions in-flight.
-#ifdef NO_PTHREADS
+// IF we don't have pthreads, or we are built to use compiler-supported
+// thread-local storage, then we use a per-thread structure.  This will leak
+// memory if we terminate any threads with exceptions in-flight.
+#if defined(NO_PTHREADS) || defined(COMPILER_TLS)
 static __thread struct thread_data thread_data;
 #else
 void clean_tls(void *td)
@@ -544,7 +544,7 @@ void init_key(void)
 
 struct thread_data *get_thread_data(void)
 {
-#ifndef NO_PTHREADS
+#if !defined(NO_PTHREADS) && !defined(COMPILER_TLS)
 	static pthread_once_t once_control = PTHREAD_ONCE_INIT;
 	pthread_once(&once_control, init_key);
 	struct thread_data *td = pthread_getspecific(key);
@@ -559,17 +559,17 @@ struct thread_data *get_thread_data(void)
 	}
 	return td;
 #else
-	return &td;
+	return &thread_data;
 #endif
 }
 
 struct thread_data *get_thread_data_fast(void)
 {
-#ifndef NO_PTHREADS
+#if !defined(NO_PTHREADS) && !defined(COMPILER_TLS)
 	struct thread_data *td = pthread_getspecific(key);
 	return td;
 #else
-	return &td;
+	return &thread_data;
 #endif
 }
 
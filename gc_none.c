@@ -2,18 +2,31 @@
 #include "objc/runtime.h"
 #include "gc_ops.h"
 #include "class.h"
+#include "refcount.h"
+#include "slab.h"
 #include <stdlib.h>
 #include <stdio.h>
 
+#ifdef SLAB_ALLOCATOR
+#	define allocate_object(size) slab_alloc(size)
+#	define deallocate_object(ptr) slab_free(ptr)
+#else
+#	define allocate_object(size) calloc(size, 1)
+#	define deallocate_object(ptr) free(ptr)
+#endif
+
 static id allocate_class(Class cls, size_t extraBytes)
 {
-	intptr_t *addr = calloc(cls->instance_size + extraBytes + sizeof(intptr_t), 1);
-	return (id)(addr + 1);
+	intptr_t *addr = allocate_object(cls->instance_size + extraBytes +
+			OBJECT_HEADER_WORDS * sizeof(intptr_t));
+	id obj = (id)(addr + OBJECT_HEADER_WORDS);
+	init_refcount(obj);
+	return obj;
 }
 
 static void free_object(id obj)
 {
-	free((void*)(((intptr_t*)obj) - 1));
+	deallocate_object((void*)(((intptr_t*)obj) - OBJECT_HEADER_WORDS));
 }
 
 static void *alloc(size_t size)
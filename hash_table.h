@@ -16,6 +16,14 @@
  *
  * Optionally, MAP_TABLE_STATIC_SIZE may be defined, to define a table type
  * which has a static size.
+ *
+ * Alternatively, MAP_TABLE_CONCURRENT may be defined for tables of pointers
+ * that are read far more often than they are written.  Lookups in these
+ * tables never block and never take the lock.  Inserts claim cells with an
+ * atomic compare-and-swap and values are never moved, so there is no
+ * rebalancing.  When the table grows, values are copied to the new array a
+ * chunk at a time by subsequent inserts and the old array is freed once no
+ * readers can be using it.  Removal is not supported.
  */
 #include "lock.h"
 #include <unistd.h>
@@ -70,8 +78,12 @@
 #	define MAP_LOCK() (LOCK(&table->lock))
 #	define MAP_UNLOCK() (UNLOCK(&table->lock))
 #endif
+#if defined(MAP_TABLE_CONCURRENT) && defined(MAP_TABLE_VALUE_TYPE)
+#	error Concurrent map tables must store pointers
+#endif
 #ifndef MAP_TABLE_VALUE_TYPE
 #	define MAP_TABLE_VALUE_TYPE void*
+__attribute__((unused))
 static BOOL PREFIX(_is_null)(void *value)
 {
 	return value == NULL;
@@ -81,6 +93,715 @@ static BOOL PREFIX(_is_null)(void *value)
 #	define MAP_TABLE_VALUE_PLACEHOLDER NULL
 #endif
 
+#ifdef MAP_TABLE_CONCURRENT
+#	ifdef MAP_TABLE_STATIC_SIZE
+#		error Concurrent map tables can not have a static size
+#	endif
+#	ifdef MAP_TABLE_NO_LOCK
+#		error Concurrent map tables need a lock to serialise resizing
+#	endif
+#	ifdef MAP_TABLE_ACCESS_BY_REFERENCE
+#		error Concurrent map tables can not be accessed by reference
+#	endif
+
+/**
+ * Number of cells, starting at the one that the hash selects, in which a value
+ * may be stored.
+ */
+#define MAP_TABLE_NEIGHBOURHOOD 32
+/**
+ * Number of cells that a thread migrates from the old array in one go when it
+ * helps with a resize.
+ */
+#define MAP_TABLE_MIGRATE_CHUNK 64
+/**
+ * Number of reader counters per epoch.  Readers are spread across these to
+ * avoid contending on a single cache line.
+ */
+#define MAP_TABLE_READER_STRIPES 16
+/**
+ * Value stored in the empty cells of an array that has been replaced.  Inserts
+ * can not claim a sealed cell, so nothing is added behind the migration.
+ */
+#define MAP_TABLE_SEALED ((void*)1)
+
+/**
+ * Cell array for a concurrent table.  Cells are only ever changed from NULL to
+ * a value (or to MAP_TABLE_SEALED), so readers never see a value move.
+ */
+struct PREFIX(_table_array)
+{
+	/** Number of cells in this array. */
+	uint32_t size;
+	/** Index of the next cell in prev that should be migrated. */
+	uint32_t migrate_next;
+	/** Number of cells in prev that have been migrated. */
+	uint32_t migrate_done;
+	/**
+	 * Set if a value from prev could not be placed in this array.  The value
+	 * stays in prev, and the thread that finishes the migration replaces this
+	 * array with a larger one.
+	 */
+	uint32_t overflowed;
+	/**
+	 * The array that this one replaced.  Set until all of its values have
+	 * been copied into this array.
+	 */
+	struct PREFIX(_table_array) *prev;
+	/**
+	 * Hashes of the values in the corresponding cells, stored after the
+	 * cells.  Zero if not yet known.  Lookups use these to skip comparing
+	 * keys with values that have different hashes, and migration uses them
+	 * to avoid rehashing.
+	 */
+	uint32_t *hashes;
+	MAP_TABLE_VALUE_TYPE cells[];
+};
+
+/**
+ * Count of readers in a critical section, padded to a cache line.
+ */
+struct PREFIX(_reader_count)
+{
+	long count;
+	char padding[64 - sizeof(long)];
+};
+
+typedef struct PREFIX(_table_struct)
+{
+	/**
+	 * Lock protecting resizes and reclamation.  Lookups and inserts do not
+	 * acquire it.
+	 */
+	mutex_t lock;
+	unsigned int table_size;
+	unsigned int table_used;
+	/** Current reader epoch.  The low bit selects the counters to use. */
+	unsigned int epoch;
+	struct PREFIX(_table_array) *current;
+	struct PREFIX(_reader_count) readers[2][MAP_TABLE_READER_STRIPES];
+} PREFIX(_table);
+
+static struct PREFIX(_table_array) *PREFIX(_alloc_array)(uint32_t size)
+{
+	struct PREFIX(_table_array) *array = CALLOC(1,
+		sizeof(struct PREFIX(_table_array)) +
+		size * (sizeof(MAP_TABLE_VALUE_TYPE) + sizeof(uint32_t)));
+	if (NULL != array)
+	{
+		array->size = size;
+		array->hashes = (uint32_t*)&array->cells[size];
+	}
+	return array;
+}
+
+PREFIX(_table) *PREFIX(_create)(uint32_t capacity)
+{
+	PREFIX(_table) *table = CALLOC(1, sizeof(PREFIX(_table)));
+	INIT_LOCK(table->lock);
+	table->current = PREFIX(_alloc_array)(capacity);
+	table->table_size = capacity;
+	return table;
+}
+
+void PREFIX(_initialize)(PREFIX(_table) **table, uint32_t capacity)
+{
+#ifdef ENABLE_GC
+	GC_add_roots(table, table+1);
+#endif
+	*table = PREFIX(_create)(capacity);
+}
+
+/**
+ * Enters a read-side critical section.  No array that is reachable from the
+ * table when this returns will be freed until the matching call to
+ * _read_end().  This never blocks.
+ */
+static inline long *PREFIX(_read_begin)(PREFIX(_table) *table)
+{
+	uintptr_t stack = (uintptr_t)&stack;
+	// Threads have different stacks, so this spreads them over the stripes.
+	uint32_t stripe = ((uint32_t)(stack >> 12) * 2654435761U) >> 16;
+	unsigned int epoch = __atomic_load_n(&table->epoch, __ATOMIC_RELAXED) & 1;
+	long *count =
+		&table->readers[epoch][stripe % MAP_TABLE_READER_STRIPES].count;
+	__atomic_fetch_add(count, 1, __ATOMIC_SEQ_CST);
+	return count;
+}
+
+static inline void PREFIX(_read_end)(long *count)
+{
+	__atomic_fetch_sub(count, 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Waits until every reader that might have seen an array that is no longer
+ * reachable from the table has left its critical section.  The epoch is
+ * flipped twice, because a reader may have sampled the epoch just before the
+ * first flip and not yet incremented its counter.  Must be called with the
+ * table locked and not from inside a read-side critical section.
+ */
+static void PREFIX(_synchronize)(PREFIX(_table) *table)
+{
+	for (int i=0 ; i<2 ; i++)
+	{
+		unsigned int epoch =
+			__atomic_fetch_add(&table->epoch, 1, __ATOMIC_SEQ_CST) & 1;
+		for (int j=0 ; j<MAP_TABLE_READER_STRIPES ; j++)
+		{
+			while (0 != __atomic_load_n(&table->readers[epoch][j].count,
+			                            __ATOMIC_SEQ_CST))
+			{
+				sleep(0);
+			}
+		}
+	}
+}
+
+/**
+ * Frees an array once no readers can be using it.  Must be called with the
+ * table locked.
+ */
+static void PREFIX(_retire)(PREFIX(_table) *table,
+                            struct PREFIX(_table_array) *array)
+{
+#ifndef ENABLE_GC
+	PREFIX(_synchronize)(table);
+	free(array);
+#endif
+}
+
+/**
+ * Looks up a key in a single array.  Values are never moved or removed, so
+ * the first empty cell in the neighbourhood ends the search.
+ */
+static MAP_TABLE_VALUE_TYPE PREFIX(_array_get)(struct PREFIX(_table_array) *array,
+                                               const void *key,
+                                               uint32_t hash)
+{
+	for (uint32_t i=0 ; i<MAP_TABLE_NEIGHBOURHOOD ; i++)
+	{
+		uint32_t index = (hash + i) % array->size;
+		MAP_TABLE_VALUE_TYPE value =
+			__atomic_load_n(&array->cells[index], __ATOMIC_ACQUIRE);
+		if ((NULL == value) || (MAP_TABLE_SEALED == value))
+		{
+			return NULL;
+		}
+		uint32_t cellHash = __atomic_load_n(&array->hashes[index], __ATOMIC_RELAXED);
+		if ((0 != cellHash) && (hash != cellHash))
+		{
+			continue;
+		}
+		if (MAP_TABLE_COMPARE_FUNCTION(key, value))
+		{
+			return value;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Claims the first empty cell in the neighbourhood of the hash.  Returns 1 on
+ * success, 0 if the neighbourhood is full, or -1 if the array has been
+ * replaced and its empty cells sealed.
+ */
+static int PREFIX(_array_insert)(struct PREFIX(_table_array) *array,
+                                 MAP_TABLE_VALUE_TYPE value,
+                                 uint32_t hash)
+{
+	for (uint32_t i=0 ; i<MAP_TABLE_NEIGHBOURHOOD ; i++)
+	{
+		uint32_t index = (hash + i) % array->size;
+		MAP_TABLE_VALUE_TYPE *cell = &array->cells[index];
+		MAP_TABLE_VALUE_TYPE old = __atomic_load_n(cell, __ATOMIC_ACQUIRE);
+		while (NULL == old)
+		{
+			if (__atomic_compare_exchange_n(cell, &old, value, 0,
+			                                __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+			{
+				// Readers that see the value before the hash will just
+				// compare the keys.
+				__atomic_store_n(&array->hashes[index], hash, __ATOMIC_RELAXED);
+				return 1;
+			}
+		}
+		if (MAP_TABLE_SEALED == old)
+		{
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/**
+ * Copies the next chunk of values from the previous array into this one.
+ * Must be called from inside a read-side critical section.  Returns YES if
+ * this call finished the migration, in which case the caller must call
+ * _finish_migration() once it has left the critical section.
+ */
+static BOOL PREFIX(_migrate)(struct PREFIX(_table_array) *array,
+                             struct PREFIX(_table_array) *prev)
+{
+	uint32_t start = __atomic_fetch_add(&array->migrate_next,
+	                                    MAP_TABLE_MIGRATE_CHUNK, __ATOMIC_RELAXED);
+	if (start >= prev->size)
+	{
+		return NO;
+	}
+	uint32_t end = start + MAP_TABLE_MIGRATE_CHUNK;
+	if (end > prev->size)
+	{
+		end = prev->size;
+	}
+	for (uint32_t i=start ; i<end ; i++)
+	{
+		MAP_TABLE_VALUE_TYPE value = NULL;
+		// Seal empty cells, so that a late insert into the old array fails
+		// and retries with this one, rather than being lost.
+		if (__atomic_compare_exchange_n(&prev->cells[i], &value, MAP_TABLE_SEALED,
+		                                0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		{
+			continue;
+		}
+		uint32_t hash = __atomic_load_n(&prev->hashes[i], __ATOMIC_RELAXED);
+		if (0 == hash)
+		{
+			hash = MAP_TABLE_HASH_VALUE(value);
+		}
+		// If the neighbourhood is full, leave the value in the old array,
+		// where lookups will still find it, and grow this array when the
+		// migration finishes.
+		if (1 != PREFIX(_array_insert)(array, value, hash))
+		{
+			__atomic_store_n(&array->overflowed, 1, __ATOMIC_RELAXED);
+		}
+	}
+	return __atomic_add_fetch(&array->migrate_done, end - start,
+	                          __ATOMIC_ACQ_REL) == prev->size;
+}
+
+/**
+ * Seals every empty cell in an array, so that no more values can be inserted
+ * into it.
+ */
+static void PREFIX(_seal_array)(struct PREFIX(_table_array) *array)
+{
+	for (uint32_t i=0 ; i<array->size ; i++)
+	{
+		MAP_TABLE_VALUE_TYPE value = NULL;
+		__atomic_compare_exchange_n(&array->cells[i], &value, MAP_TABLE_SEALED,
+		                            0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+	}
+}
+
+/**
+ * Returns whether this exact value is stored in an array.
+ */
+static BOOL PREFIX(_array_contains)(struct PREFIX(_table_array) *array,
+                                    MAP_TABLE_VALUE_TYPE value,
+                                    uint32_t hash)
+{
+	for (uint32_t i=0 ; i<MAP_TABLE_NEIGHBOURHOOD ; i++)
+	{
+		MAP_TABLE_VALUE_TYPE cell =
+			__atomic_load_n(&array->cells[(hash + i) % array->size], __ATOMIC_ACQUIRE);
+		if ((NULL == cell) || (MAP_TABLE_SEALED == cell))
+		{
+			return NO;
+		}
+		if (cell == value)
+		{
+			return YES;
+		}
+	}
+	return NO;
+}
+
+/**
+ * Copies every value in src that is not also in skip (which may be NULL) into
+ * dst.  Returns NO if a value did not fit.
+ */
+static BOOL PREFIX(_copy_array)(struct PREFIX(_table_array) *dst,
+                                struct PREFIX(_table_array) *src,
+                                struct PREFIX(_table_array) *skip)
+{
+	for (uint32_t i=0 ; i<src->size ; i++)
+	{
+		MAP_TABLE_VALUE_TYPE value =
+			__atomic_load_n(&src->cells[i], __ATOMIC_ACQUIRE);
+		if ((NULL == value) || (MAP_TABLE_SEALED == value))
+		{
+			continue;
+		}
+		uint32_t hash = __atomic_load_n(&src->hashes[i], __ATOMIC_RELAXED);
+		if (0 == hash)
+		{
+			hash = MAP_TABLE_HASH_VALUE(value);
+		}
+		if ((NULL != skip) && PREFIX(_array_contains)(skip, value, hash))
+		{
+			continue;
+		}
+		if (1 != PREFIX(_array_insert)(dst, value, hash))
+		{
+			return NO;
+		}
+	}
+	return YES;
+}
+
+/**
+ * Replaces an array whose migration left values behind in the previous array
+ * with a larger one that holds the values from both.  Both arrays are sealed
+ * first, so concurrent inserts retry with the new array instead of being
+ * lost.  Readers that still hold the old array find every value in it or in
+ * its prev, which is left set.  Must be called with the table locked.
+ */
+static void PREFIX(_grow_locked)(PREFIX(_table) *table,
+                                 struct PREFIX(_table_array) *array)
+{
+	struct PREFIX(_table_array) *prev = array->prev;
+	PREFIX(_seal_array)(prev);
+	PREFIX(_seal_array)(array);
+	uint64_t size = array->size;
+	struct PREFIX(_table_array) *newArray = NULL;
+	while (NULL == newArray)
+	{
+		size *= 2;
+		if (size > UINT32_MAX)
+		{
+			break;
+		}
+		newArray = PREFIX(_alloc_array)((uint32_t)size);
+		if (NULL == newArray)
+		{
+			break;
+		}
+		if (!PREFIX(_copy_array)(newArray, array, NULL) ||
+		    !PREFIX(_copy_array)(newArray, prev, array))
+		{
+#ifndef ENABLE_GC
+			free(newArray);
+#endif
+			newArray = NULL;
+		}
+	}
+	if (NULL == newArray)
+	{
+		fprintf(stderr, "Unable to grow hash table\n");
+		abort();
+	}
+	table->table_size = newArray->size;
+	__atomic_store_n(&table->current, newArray, __ATOMIC_SEQ_CST);
+	PREFIX(_retire)(table, prev);
+	PREFIX(_retire)(table, array);
+}
+
+/**
+ * Detaches and retires the previous array, once every value in it has been
+ * copied into this one, or replaces this array if some did not fit.  Does
+ * nothing if another thread has already done so.
+ */
+static void PREFIX(_finish_migration)(PREFIX(_table) *table,
+                                      struct PREFIX(_table_array) *array)
+{
+	LOCK(&table->lock);
+	struct PREFIX(_table_array) *prev =
+		__atomic_load_n(&array->prev, __ATOMIC_SEQ_CST);
+	if ((table->current == array) && (NULL != prev))
+	{
+		if (__atomic_load_n(&array->overflowed, __ATOMIC_RELAXED))
+		{
+			PREFIX(_grow_locked)(table, array);
+		}
+		else
+		{
+			__atomic_store_n(&array->prev, NULL, __ATOMIC_SEQ_CST);
+			PREFIX(_retire)(table, prev);
+		}
+	}
+	UNLOCK(&table->lock);
+}
+
+/**
+ * Completes any migration that is in progress and returns the current array.
+ * Must be called with the table locked, which prevents another resize from
+ * starting.
+ */
+static struct PREFIX(_table_array) *PREFIX(_finish_migration_locked)(PREFIX(_table) *table)
+{
+	struct PREFIX(_table_array) *array;
+	struct PREFIX(_table_array) *prev;
+	// Finishing the migration may replace the current array.
+	while (NULL != (prev = __atomic_load_n(&(array = table->current)->prev,
+	                                       __ATOMIC_SEQ_CST)))
+	{
+		// The old array can't be freed while we hold the lock, unless we
+		// free it ourselves.  The thread that copies the last chunk will
+		// block on the lock to finish the migration, so finish it for them.
+		if (PREFIX(_migrate)(array, prev) ||
+		    (__atomic_load_n(&array->migrate_done, __ATOMIC_ACQUIRE) == prev->size))
+		{
+			PREFIX(_finish_migration)(table, array);
+		}
+		else if (__atomic_load_n(&array->migrate_next, __ATOMIC_RELAXED) >= prev->size)
+		{
+			// Other threads are copying the last chunks.
+			sleep(0);
+		}
+	}
+	return array;
+}
+
+/**
+ * Replaces the current array with a new one of the specified size.  The
+ * values are copied across incrementally by subsequent inserts.  Must be
+ * called with the table locked and no migration in progress.
+ */
+static void PREFIX(_replace_array_locked)(PREFIX(_table) *table,
+                                          struct PREFIX(_table_array) *array,
+                                          uint32_t size)
+{
+	struct PREFIX(_table_array) *newArray = PREFIX(_alloc_array)(size);
+	if (NULL != newArray)
+	{
+		newArray->prev = array;
+		table->table_size = newArray->size;
+		__atomic_store_n(&table->current, newArray, __ATOMIC_SEQ_CST);
+	}
+}
+
+/**
+ * Replaces the specified array with one twice the size, if it is still the
+ * current array and its own migration has finished.
+ */
+static void PREFIX(_table_resize)(PREFIX(_table) *table,
+                                  struct PREFIX(_table_array) *array)
+{
+	LOCK(&table->lock);
+	if ((table->current == array) &&
+	    (NULL == __atomic_load_n(&array->prev, __ATOMIC_SEQ_CST)))
+	{
+		PREFIX(_replace_array_locked)(table, array, array->size * 2);
+	}
+	UNLOCK(&table->lock);
+}
+
+/**
+ * Grows the table, if necessary, so that the specified number of values can
+ * be inserted without triggering another resize.  This lets a caller that is
+ * about to insert a batch of values pay for one resize, rather than several.
+ */
+__attribute__((unused))
+static void PREFIX(_reserve)(PREFIX(_table) *table, uint32_t count)
+{
+	LOCK(&table->lock);
+	struct PREFIX(_table_array) *array = PREFIX(_finish_migration_locked)(table);
+	uint64_t needed = (uint64_t)__atomic_load_n(&table->table_used,
+	                                            __ATOMIC_RELAXED) + count;
+	uint64_t size = array->size;
+	while (needed > (0.75 * size))
+	{
+		size *= 2;
+	}
+	if ((size != array->size) && (size <= UINT32_MAX))
+	{
+		PREFIX(_replace_array_locked)(table, array, (uint32_t)size);
+	}
+	UNLOCK(&table->lock);
+}
+
+/**
+ * Inserts a value.  Concurrent inserts are safe, but the caller is
+ * responsible for ensuring that the same key is not inserted twice.
+ */
+__attribute__((unused))
+static int PREFIX(_insert)(PREFIX(_table) *table, MAP_TABLE_VALUE_TYPE value)
+{
+	uint32_t hash = MAP_TABLE_HASH_VALUE(value);
+	// If a hash function is bad enough that doubling the table a few times
+	// does not give us a free cell, more doubling won't help.
+	for (int resizes=0 ; resizes<8 ;)
+	{
+		long *reader = PREFIX(_read_begin)(table);
+		struct PREFIX(_table_array) *array =
+			__atomic_load_n(&table->current, __ATOMIC_SEQ_CST);
+		struct PREFIX(_table_array) *prev =
+			__atomic_load_n(&array->prev, __ATOMIC_SEQ_CST);
+		BOOL finished = NO;
+		// Every insert during a migration copies a chunk, so the migration
+		// finishes long before the new array needs resizing.
+		if (NULL != prev)
+		{
+			finished = PREFIX(_migrate)(array, prev);
+		}
+		int result = PREFIX(_array_insert)(array, value, hash);
+		uint32_t size = array->size;
+		PREFIX(_read_end)(reader);
+		if (finished)
+		{
+			PREFIX(_finish_migration)(table, array);
+		}
+		if (result > 0)
+		{
+			unsigned int used = __atomic_add_fetch(&table->table_used, 1,
+			                                       __ATOMIC_RELAXED);
+			// Neighbourhoods are probed linearly, so keep the load low enough
+			// that they rarely fill up.
+			if (used > (0.75 * size))
+			{
+				PREFIX(_table_resize)(table, array);
+			}
+			return 1;
+		}
+		if ((0 == result) && (NULL == prev))
+		{
+			PREFIX(_table_resize)(table, array);
+			resizes++;
+		}
+	}
+	fprintf(stderr, "Insert failed\n");
+	return 0;
+}
+
+__attribute__((unused))
+static MAP_TABLE_VALUE_TYPE PREFIX(_table_get)(PREFIX(_table) *table,
+                                               const void *key)
+{
+	uint32_t hash = MAP_TABLE_HASH_KEY(key);
+	long *reader = PREFIX(_read_begin)(table);
+	struct PREFIX(_table_array) *array =
+		__atomic_load_n(&table->current, __ATOMIC_SEQ_CST);
+	// Check for a migration before searching.  If there is none, then every
+	// value from older arrays was already in this one when we started.
+	struct PREFIX(_table_array) *prev =
+		__atomic_load_n(&array->prev, __ATOMIC_SEQ_CST);
+	MAP_TABLE_VALUE_TYPE value = PREFIX(_array_get)(array, key, hash);
+	if ((NULL == value) && (NULL != prev))
+	{
+		value = PREFIX(_array_get)(prev, key, hash);
+	}
+	PREFIX(_read_end)(reader);
+	return value;
+}
+
+/**
+ * Replaces the value for a key, or inserts it if there is none.  Updates to
+ * the same key must be serialised by the caller.
+ */
+__attribute__((unused))
+static void PREFIX(_table_set)(PREFIX(_table) *table, const void *key,
+		MAP_TABLE_VALUE_TYPE value)
+{
+	uint32_t hash = MAP_TABLE_HASH_KEY(key);
+	LOCK(&table->lock);
+	// With the lock held and no migration in progress, every value is in the
+	// current array and stays there.
+	struct PREFIX(_table_array) *array = PREFIX(_finish_migration_locked)(table);
+	for (uint32_t i=0 ; i<MAP_TABLE_NEIGHBOURHOOD ; i++)
+	{
+		uint32_t index = (hash + i) % array->size;
+		MAP_TABLE_VALUE_TYPE *cell = &array->cells[index];
+		MAP_TABLE_VALUE_TYPE old = __atomic_load_n(cell, __ATOMIC_ACQUIRE);
+		if (NULL == old)
+		{
+			break;
+		}
+		uint32_t cellHash = __atomic_load_n(&array->hashes[index], __ATOMIC_RELAXED);
+		if ((0 != cellHash) && (hash != cellHash))
+		{
+			continue;
+		}
+		if (MAP_TABLE_COMPARE_FUNCTION(key, old))
+		{
+			__atomic_store_n(cell, value, __ATOMIC_RELEASE);
+			UNLOCK(&table->lock);
+			return;
+		}
+	}
+	UNLOCK(&table->lock);
+	PREFIX(_insert)(table, value);
+}
+
+/**
+ * Enumerator state.  Holds a copy of the values, so that an enumeration does
+ * not need to stop arrays from being freed and may be abandoned part way.
+ */
+struct PREFIX(_table_enumerator)
+{
+	unsigned int count;
+	unsigned int index;
+	MAP_TABLE_VALUE_TYPE values[];
+};
+
+/**
+ * Copies the values from the table's current array into a new enumerator.
+ * The copy is made in a read-side critical section, which is entered before
+ * the lock is released so that the array can not be replaced and freed
+ * first.
+ */
+static struct PREFIX(_table_enumerator) *PREFIX(_enumerator_create)(PREFIX(_table) *table)
+{
+	LOCK(&table->lock);
+	// With the migration finished, every value is in the current array.
+	struct PREFIX(_table_array) *array = PREFIX(_finish_migration_locked)(table);
+	long *reader = PREFIX(_read_begin)(table);
+	UNLOCK(&table->lock);
+	unsigned int count = 0;
+	for (uint32_t i=0 ; i<array->size ; i++)
+	{
+		MAP_TABLE_VALUE_TYPE value =
+			__atomic_load_n(&array->cells[i], __ATOMIC_ACQUIRE);
+		if ((NULL != value) && (MAP_TABLE_SEALED != value))
+		{
+			count++;
+		}
+	}
+	struct PREFIX(_table_enumerator) *state =
+		CALLOC(1, sizeof(struct PREFIX(_table_enumerator)) +
+		          count * sizeof(MAP_TABLE_VALUE_TYPE));
+	// Values inserted since they were counted are not returned.
+	for (uint32_t i=0 ; (i<array->size) && (state->count < count) ; i++)
+	{
+		MAP_TABLE_VALUE_TYPE value =
+			__atomic_load_n(&array->cells[i], __ATOMIC_ACQUIRE);
+		if ((NULL != value) && (MAP_TABLE_SEALED != value))
+		{
+			state->values[state->count++] = value;
+		}
+	}
+	PREFIX(_read_end)(reader);
+	return state;
+}
+
+/**
+ * Enumerates the table.  Values inserted during enumeration may or may not be
+ * returned.
+ */
+__attribute__((unused))
+static MAP_TABLE_VALUE_TYPE PREFIX(_next)(PREFIX(_table) *table,
+                    struct PREFIX(_table_enumerator) **state)
+{
+	if (NULL == *state)
+	{
+		*state = PREFIX(_enumerator_create)(table);
+	}
+	if ((*state)->index < (*state)->count)
+	{
+		return (*state)->values[(*state)->index++];
+	}
+#ifndef ENABLE_GC
+	free(*state);
+#endif
+	return NULL;
+}
+
+#undef MAP_TABLE_NEIGHBOURHOOD
+#undef MAP_TABLE_MIGRATE_CHUNK
+#undef MAP_TABLE_READER_STRIPES
+#undef MAP_TABLE_SEALED
+#else
 typedef struct PREFIX(_table_cell_struct)
 {
 	uint32_t secondMaps;
@@ -175,11 +896,13 @@ static int PREFIX(_table_resize)(PREFIX(_table) *table)
 	// lookups will try using that one, if possible.
 	PREFIX(_table) *copy = CALLOC(1, sizeof(PREFIX(_table)));
 	memcpy(copy, table, sizeof(PREFIX(_table)));
-	table->old = copy;
+	__atomic_store_n(&table->old, copy, __ATOMIC_RELEASE);
 
 	// Now we make the original table structure point to the new (empty) array.
+	// The size is published after the array, so a reader that sees the new
+	// size will never index the old, smaller, array with it.
 	table->table = newArray;
-	table->table_size *= 2;
+	__atomic_store_n(&table->table_size, table->table_size * 2, __ATOMIC_RELEASE);
 	// The table currently has no entries; the copy has them all.
 	table->table_used = 0;
 
@@ -197,7 +920,7 @@ static int PREFIX(_table_resize)(PREFIX(_table) *table)
 		}
 	}
 	__sync_synchronize();
-	table->old = NULL;
+	__atomic_store_n(&table->old, NULL, __ATOMIC_RELEASE);
 #	if !defined(ENABLE_GC) && defined(MAP_TABLE_SINGLE_THREAD)
 	free(copy->table);
 	free(copy);
@@ -216,7 +939,11 @@ struct PREFIX(_table_enumerator)
 static inline PREFIX(_table_cell) PREFIX(_table_lookup)(PREFIX(_table) *table, 
                                                         uint32_t hash)
 {
+#ifdef MAP_TABLE_STATIC_SIZE
 	hash = hash % TABLE_SIZE(table);
+#else
+	hash = hash % __atomic_load_n(&table->table_size, __ATOMIC_ACQUIRE);
+#endif
 	return &table->table[hash];
 }
 
@@ -358,9 +1085,10 @@ static void *PREFIX(_table_get_cell)(PREFIX(_table) *table, const void *key)
 		}
 	}
 #ifndef MAP_TABLE_STATIC_SIZE
-	if (table->old)
+	PREFIX(_table) *old = __atomic_load_n(&table->old, __ATOMIC_ACQUIRE);
+	if (old)
 	{
-		return PREFIX(_table_get_cell)(table->old, key);
+		return PREFIX(_table_get_cell)(old, key);
 	}
 #endif
 	return NULL;
@@ -522,6 +1250,8 @@ PREFIX(_current)(PREFIX(_table) *table,
 #endif
 }
 
+#endif
+
 #undef TABLE_SIZE
 #undef REALLY_PREFIX_SUFFIX
 #undef PREFIX_SUFFIX
@@ -548,6 +1278,10 @@ PREFIX(_current)(PREFIX(_table) *table,
 #	undef MAP_TABLE_SINGLE_THREAD
 #endif
 
+#ifdef MAP_TABLE_CONCURRENT
+#	undef MAP_TABLE_CONCURRENT
+#endif
+
 #undef MAP_TABLE_VALUE_NULL
 #undef MAP_TABLE_VALUE_PLACEHOLDER
 
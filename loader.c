@@ -24,14 +24,27 @@ void init_dispatch_tables(void);
 void init_gc(void);
 void init_protocol_table(void);
 void init_selector_tables(void);
+void init_sync(void);
 void init_trampolines(void);
 void objc_send_load_message(Class class);
 
 void log_selector_memory_usage(void);
+void log_dtable_memory_usage(void);
+void log_dispatch_stats(void);
+void log_allocation_stats(void);
 
 static void log_memory_stats(void)
 {
 	log_selector_memory_usage();
+#ifndef __OBJC_LOW_MEMORY__
+	log_dtable_memory_usage();
+#endif
+#ifdef DISPATCH_STATS
+	log_dispatch_stats();
+#endif
+#ifdef SLAB_ALLOCATOR
+	log_allocation_stats();
+#endif
 }
 
 /* Number of threads that are alive.  */
@@ -75,6 +88,7 @@ void __objc_exec_class(struct objc_module_abi_8 *module)
 		init_dispatch_tables();
 		init_alias_table();
 		init_arc();
+		init_sync();
 		init_trampolines();
 		first_run = NO;
 		if (getenv("LIBOBJC_MEMORY_PROFILE"))
@@ -15,6 +15,7 @@ typedef HANDLE mutex_t;
 #	define LOCK(x) WaitForSingleObject(*x, INFINITE)
 #	define UNLOCK(x) ReleaseMutex(*x)
 #	define DESTROY_LOCK(x) CloseHandle(*x)
+#	define INIT_NONRECURSIVE_LOCK(x) INIT_LOCK(x)
 #else
 
 #	include <pthread.h>
@@ -42,6 +43,12 @@ static inline void init_recursive_mutex(pthread_mutex_t *x)
 #	define LOCK(x) pthread_mutex_lock(x)
 #	define UNLOCK(x) pthread_mutex_unlock(x)
 #	define DESTROY_LOCK(x) pthread_mutex_destroy(x)
+/**
+ * Initialises a lock that may be cheaper than a recursive one, for use where
+ * the code holding it never tries to acquire it again.  On platforms with
+ * only recursive mutexes, this is the same as INIT_LOCK().
+ */
+#	define INIT_NONRECURSIVE_LOCK(x) pthread_mutex_init(&(x), NULL)
 #endif
 
 __attribute__((unused)) static void objc_release_lock(void *x)
@@ -89,6 +89,24 @@ void objc_moveWeak(id *dest, id *src);
  * Releases an object.  Equivalent to [obj release].
  */
 void objc_release(id obj);
+/**
+ * Retains each of the count objects in the array, which may contain nil.
+ * Each element is replaced by the value that objc_retain() would return for
+ * it, which is only different for blocks on the stack.  This is faster than
+ * calling objc_retain() for each element when many of them have the same
+ * class.
+ *
+ * Nonstandard extension.
+ */
+void objc_retainArray_np(id *objects, size_t count);
+/**
+ * Releases each of the count objects in the array, which may contain nil.
+ * This is faster than calling objc_release() for each element when many of
+ * them have the same class.
+ *
+ * Nonstandard extension.
+ */
+void objc_releaseArray_np(id *objects, size_t count);
 /**
  * Mark the object as about to begin deallocation.  All subsequent reads of
  * weak pointers will return 0.  This function should be called in -release,
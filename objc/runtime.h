@@ -840,6 +840,81 @@ unsigned sel_copyTypedSelectors_np(const char *selName, SEL *const sels, unsigne
 extern struct objc_slot *objc_msg_lookup_sender(id *receiver, SEL selector, id sender)
 	OBJC_NONPORTABLE;
 
+/**
+ * Lookup function using a call-site polymorphic inline cache.  This behaves in
+ * the same way as objc_msg_lookup_sender(), but first checks the classes
+ * recorded in the cache.  The cache must be zero-initialised before first use
+ * and must not be shared between call sites that send different selectors.
+ */
+struct objc_slot *objc_slot_lookup_cached_np(id *receiver, SEL selector,
+                                             id sender,
+                                             struct objc_slot_cache *cache)
+	OBJC_NONPORTABLE;
+
+/**
+ * Counts of message sends that left the fast path, and of how autoreleased
+ * return values were passed back, summed over all threads.
+ */
+struct objc_dispatch_stats_np
+{
+	/** Lookups that missed in the dispatch table. */
+	uint64_t slow_lookups;
+	/** Methods that were only found using the untyped selector. */
+	uint64_t untyped_fallbacks;
+	/** Receivers that were replaced by the objc_proxy_lookup() hook. */
+	uint64_t proxy_lookups;
+	/** Sends that were passed to the __objc_msg_forward3() hook. */
+	uint64_t forwards;
+	/** Lookups that had to wait for another thread to finish +initialize. */
+	uint64_t initialize_waits;
+	/** Selectors that were registered when they were first sent. */
+	uint64_t lazy_selector_registrations;
+	/**
+	 * Values returned with objc_autoreleaseReturnValue() that were claimed by
+	 * objc_retainAutoreleasedReturnValue() without using the autorelease pool.
+	 */
+	uint64_t return_values_elided;
+	/**
+	 * Values returned with objc_autoreleaseReturnValue() that were put in the
+	 * autorelease pool.
+	 */
+	uint64_t return_values_autoreleased;
+};
+
+/**
+ * Fills in the dispatch slow-path counters.  Returns NO, and sets all of the
+ * counters to zero, if the runtime was built without support for them.
+ */
+BOOL objc_getDispatchStats_np(struct objc_dispatch_stats_np *stats)
+	OBJC_NONPORTABLE;
+
+/**
+ * Counts of objects allocated by the runtime's slab allocator, summed over all
+ * threads.
+ */
+struct objc_allocation_stats_np
+{
+	/** Objects allocated from slabs. */
+	uint64_t slab_allocations;
+	/** Objects returned to slabs. */
+	uint64_t slab_frees;
+	/** Objects returned to a slab owned by a thread other than the caller. */
+	uint64_t remote_frees;
+	/** Objects that were too large for a slab and were allocated by calloc(). */
+	uint64_t large_allocations;
+	/** Bytes of slab space used by objects that have not been freed. */
+	uint64_t bytes_in_use;
+	/** Bytes of address space reserved for slabs. */
+	uint64_t bytes_mapped;
+};
+
+/**
+ * Fills in the slab allocator counters.  Returns NO, and sets all of the
+ * counters to zero, if the runtime was built without the slab allocator.
+ */
+BOOL objc_getAllocationStats_np(struct objc_allocation_stats_np *stats)
+	OBJC_NONPORTABLE;
+
 /**
  * Registers a class for small objects.  Small objects are stored inside a
  * pointer.  If the class can be registered, then this returns YES.  The second
@@ -45,4 +45,48 @@ struct objc_slot
 	/** Selector for this method. */
 	SEL selector;
 } OBJC_NONPORTABLE;
+
+/**
+ * Number of (class, slot) pairs stored in a polymorphic inline cache.
+ */
+#define OBJC_SLOT_CACHE_SIZE 4
+/**
+ * Number of times that a full polymorphic inline cache must evict an entry
+ * before the call site is considered megamorphic.  Megamorphic call sites stop
+ * using the cache and go straight to the dispatch table.
+ */
+#define OBJC_SLOT_CACHE_MEGAMORPHIC 16
+
+/**
+ * Polymorphic inline cache.  This structure is owned by a call site and is
+ * passed to objc_slot_lookup_cached_np().  It must be zero-initialised before
+ * first use, so the simplest way of using it is to declare one as a static
+ * variable at each call site.
+ *
+ * The cache stores up to OBJC_SLOT_CACHE_SIZE classes, along with the slot and
+ * slot version that a message send to an instance of each class resolved to.
+ * Cached slots are validated against their version on every use, so entries
+ * are invalidated automatically when a method is overridden or replaced.
+ *
+ * The fields in this structure are private to the runtime.
+ */
+struct objc_slot_cache
+{
+	/** Sequence counter.  Odd while the cache is being updated. */
+	volatile unsigned int sequence;
+	/** The index of the next entry to be replaced. */
+	unsigned int next;
+	/** The number of entries that have been evicted from this cache. */
+	unsigned int evictions;
+	/** The cached entries. */
+	struct objc_slot_cache_entry
+	{
+		/** The class for which this slot was cached. */
+		Class cls;
+		/** The cached slot. */
+		struct objc_slot *slot;
+		/** The version of the slot at the time that it was cached. */
+		int version;
+	} entries[OBJC_SLOT_CACHE_SIZE];
+} OBJC_NONPORTABLE;
 #endif // __OBJC_SLOT_H_INCLUDED__
@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sched.h>
 #include "class.h"
 #include "properties.h"
 #include "spinlock.h"
@@ -12,13 +13,97 @@
 #include "gc_ops.h"
 #include "lock.h"
 
-PRIVATE int spinlocks[spinlock_count];
+PRIVATE struct padded_spinlock spinlocks[spinlock_count];
+
+BOOL retainIfFastARC(id obj);
+BOOL isFastARCObject(id obj);
 
 static inline BOOL checkAttribute(char field, int attr)
 {
 	return (field & attr) == attr;
 }
 
+/**
+ * Marks the start of a write to a value protected by the spinlock, which the
+ * caller must hold, so that lock-free readers will retry.
+ */
+static inline void beginSequencedWrite(struct padded_spinlock *lock)
+{
+	__atomic_store_n(&lock->sequence, lock->sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/**
+ * Marks the end of a write begun with beginSequencedWrite().
+ */
+static inline void endSequencedWrite(struct padded_spinlock *lock)
+{
+	__atomic_store_n(&lock->sequence, lock->sequence + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Copies a value protected by the spinlock without acquiring it.  The copy is
+ * retried if a writer modified the value while it was being read.  Only
+ * usable for plain data, because the copy may see a partially written value
+ * before it is discarded.
+ */
+static inline void sequencedRead(struct padded_spinlock *lock,
+                                 void *dest,
+                                 const void *src,
+                                 ptrdiff_t size)
+{
+	for (;;)
+	{
+		unsigned int sequence =
+			__atomic_load_n(&lock->sequence, __ATOMIC_ACQUIRE);
+		if (sequence & 1)
+		{
+			spinlock_pause();
+			continue;
+		}
+		memcpy(dest, src, size);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&lock->sequence, __ATOMIC_RELAXED) == sequence)
+		{
+			return;
+		}
+	}
+}
+
+/**
+ * Atomically replaces the object stored at addr with arg, returning the old
+ * value, which the caller must release.
+ */
+static inline id exchangeAtomicProperty(char *addr, id arg)
+{
+	struct padded_spinlock *lock = spinlock_for_pointer(addr);
+	lock_spinlock(&lock->lock);
+	id old = *(id*)addr;
+	__atomic_store_n((id*)addr, arg, __ATOMIC_SEQ_CST);
+	// A getter that loaded the old value without the lock may not have
+	// retained it yet.  Getters only retain fast-ARC objects without the
+	// lock, so there is nothing to wait for otherwise.  Getters that register
+	// with the new epoch will see the new value.  Holding the lock while
+	// waiting stops another setter from flipping the epoch back.
+	if (isFastARCObject(old))
+	{
+		unsigned int epoch =
+			__atomic_fetch_add(&lock->epoch, 1, __ATOMIC_SEQ_CST) & 1;
+		for (int count=1 ;
+		     0 != __atomic_load_n(&lock->readers[epoch], __ATOMIC_SEQ_CST) ;
+		     count++)
+		{
+			spinlock_pause();
+			if (0 == count % 64)
+			{
+				sched_yield();
+			}
+		}
+	}
+	unlock_spinlock(&lock->lock);
+	return old;
+}
+
 /**
  * Public function for getting a property.  
  */
@@ -34,11 +119,23 @@ id objc_getProperty(id obj, SEL _cmd, ptrdiff_t offset, BOOL isAtomic)
 	id ret;
 	if (isAtomic)
 	{
-		volatile int *lock = lock_for_pointer(addr);
-		lock_spinlock(lock);
-		ret = *(id*)addr;
-		ret = objc_retain(ret);
-		unlock_spinlock(lock);
+		// Setters don't release the old value while we are registered as a
+		// reader, so if it can be retained without sending a message then we
+		// don't need the lock.
+		struct padded_spinlock *lock = spinlock_for_pointer(addr);
+		int *readers = &lock->readers[
+			__atomic_load_n(&lock->epoch, __ATOMIC_SEQ_CST) & 1];
+		__atomic_fetch_add(readers, 1, __ATOMIC_SEQ_CST);
+		ret = __atomic_load_n((id*)addr, __ATOMIC_SEQ_CST);
+		BOOL retained = retainIfFastARC(ret);
+		__atomic_fetch_sub(readers, 1, __ATOMIC_RELEASE);
+		if (!retained)
+		{
+			lock_spinlock(&lock->lock);
+			ret = *(id*)addr;
+			ret = objc_retain(ret);
+			unlock_spinlock(&lock->lock);
+		}
 		ret = objc_autoreleaseReturnValue(ret);
 	}
 	else
@@ -75,11 +172,7 @@ void objc_setProperty(id obj, SEL _cmd, ptrdiff_t offset, id arg, BOOL isAtomic,
 	id old;
 	if (isAtomic)
 	{
-		volatile int *lock = lock_for_pointer(addr);
-		lock_spinlock(lock);
-		old = *(id*)addr;
-		*(id*)addr = arg;
-		unlock_spinlock(lock);
+		old = exchangeAtomicProperty(addr, arg);
 	}
 	else
 	{
@@ -94,11 +187,7 @@ void objc_setProperty_atomic(id obj, SEL _cmd, id arg, ptrdiff_t offset)
 	char *addr = (char*)obj;
 	addr += offset;
 	arg = objc_retain(arg);
-	volatile int *lock = lock_for_pointer(addr);
-	lock_spinlock(lock);
-	id old = *(id*)addr;
-	*(id*)addr = arg;
-	unlock_spinlock(lock);
+	id old = exchangeAtomicProperty(addr, arg);
 	objc_release(old);
 }
 
@@ -108,11 +197,7 @@ void objc_setProperty_atomic_copy(id obj, SEL _cmd, id arg, ptrdiff_t offset)
 	addr += offset;
 
 	arg = [arg copy];
-	volatile int *lock = lock_for_pointer(addr);
-	lock_spinlock(lock);
-	id old = *(id*)addr;
-	*(id*)addr = arg;
-	unlock_spinlock(lock);
+	id old = exchangeAtomicProperty(addr, arg);
 	objc_release(old);
 }
 
@@ -138,15 +223,19 @@ void objc_setProperty_nonatomic_copy(id obj, SEL _cmd, id arg, ptrdiff_t offset)
 void objc_copyCppObjectAtomic(void *dest, const void *src,
                               void (*copyHelper) (void *dest, const void *source))
 {
-	volatile int *lock = lock_for_pointer(src < dest ? src : dest);
-	volatile int *lock2 = lock_for_pointer(src < dest ? dest : src);
-	lock_spinlock(lock);
-	lock_spinlock(lock2);
+	volatile int *lock = lock_for_pointer(src);
+	struct padded_spinlock *destLock = spinlock_for_pointer(dest);
+	lock_spinlock_pair(lock, &destLock->lock);
+	beginSequencedWrite(destLock);
 	copyHelper(dest, src);
-	unlock_spinlock(lock);
-	unlock_spinlock(lock2);
+	endSequencedWrite(destLock);
+	unlock_spinlock_pair(lock, &destLock->lock);
 }
 
+/**
+ * Unlike structures, C++ objects are read with the lock held, because their
+ * copy constructor may not be run on a partially written object.
+ */
 void objc_getCppObjectAtomic(void *dest, const void *src,
                              void (*copyHelper) (void *dest, const void *source))
 {
@@ -159,10 +248,12 @@ void objc_getCppObjectAtomic(void *dest, const void *src,
 void objc_setCppObjectAtomic(void *dest, const void *src,
                              void (*copyHelper) (void *dest, const void *source))
 {
-	volatile int *lock = lock_for_pointer(dest);
-	lock_spinlock(lock);
+	struct padded_spinlock *lock = spinlock_for_pointer(dest);
+	lock_spinlock(&lock->lock);
+	beginSequencedWrite(lock);
 	copyHelper(dest, src);
-	unlock_spinlock(lock);
+	endSequencedWrite(lock);
+	unlock_spinlock(&lock->lock);
 }
 
 /**
@@ -180,13 +271,13 @@ void objc_copyPropertyStruct(void *dest,
 {
 	if (atomic)
 	{
-		volatile int *lock = lock_for_pointer(src < dest ? src : dest);
-		volatile int *lock2 = lock_for_pointer(src < dest ? dest : src);
-		lock_spinlock(lock);
-		lock_spinlock(lock2);
+		volatile int *lock = lock_for_pointer(src);
+		struct padded_spinlock *destLock = spinlock_for_pointer(dest);
+		lock_spinlock_pair(lock, &destLock->lock);
+		beginSequencedWrite(destLock);
 		memcpy(dest, src, size);
-		unlock_spinlock(lock);
-		unlock_spinlock(lock2);
+		endSequencedWrite(destLock);
+		unlock_spinlock_pair(lock, &destLock->lock);
 	}
 	else
 	{
@@ -196,7 +287,8 @@ void objc_copyPropertyStruct(void *dest,
 
 /**
  * Get property structure function.  Copies a structure from an ivar to another
- * variable.  Locks on the address of src.
+ * variable.  Does not lock, but retries if the structure is written while it
+ * is being copied.
  */
 void objc_getPropertyStruct(void *dest,
                             void *src,
@@ -206,10 +298,7 @@ void objc_getPropertyStruct(void *dest,
 {
 	if (atomic)
 	{
-		volatile int *lock = lock_for_pointer(src);
-		lock_spinlock(lock);
-		memcpy(dest, src, size);
-		unlock_spinlock(lock);
+		sequencedRead(spinlock_for_pointer(src), dest, src, size);
 	}
 	else
 	{
@@ -229,10 +318,12 @@ void objc_setPropertyStruct(void *dest,
 {
 	if (atomic)
 	{
-		volatile int *lock = lock_for_pointer(dest);
-		lock_spinlock(lock);
+		struct padded_spinlock *lock = spinlock_for_pointer(dest);
+		lock_spinlock(&lock->lock);
+		beginSequencedWrite(lock);
 		memcpy(dest, src, size);
-		unlock_spinlock(lock);
+		endSequencedWrite(lock);
+		unlock_spinlock(&lock->lock);
 	}
 	else
 	{
@@ -24,6 +24,7 @@ static int protocol_hash(const struct objc_protocol2 *protocol)
 #define MAP_TABLE_COMPARE_FUNCTION protocol_compare
 #define MAP_TABLE_HASH_KEY string_hash
 #define MAP_TABLE_HASH_VALUE protocol_hash
+#define MAP_TABLE_CONCURRENT
 #include "hash_table.h"
 
 static protocol_table *known_protocol_table;
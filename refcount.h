@@ -0,0 +1,39 @@
+#ifndef __OBJC_REFCOUNT_H_INCLUDED
+#define __OBJC_REFCOUNT_H_INCLUDED
+/**
+ * Layout of the reference count stored in front of objects that the runtime
+ * allocates.
+ *
+ * Normally this is a single word, holding the number of references minus one,
+ * which is updated atomically.
+ *
+ * When the runtime is built with BIASED_REFCOUNT, there are two words.  The
+ * first holds the thread that allocated the object in its high bits and a
+ * count of references held by that thread in its low bits, and is updated
+ * with plain loads and stores by that thread only.  The second holds the count
+ * of references from other threads, and is updated atomically.  See arc.m for
+ * how the two are merged.
+ */
+#include "visibility.h"
+#include "objc/runtime.h"
+
+#ifdef BIASED_REFCOUNT
+#	if !defined(__LP64__) && !defined(_WIN64)
+#		error Biased reference counting requires a 64-bit target
+#	endif
+#	ifdef ENABLE_GC
+#		error Biased reference counting can not be used with garbage collection
+#	endif
+#	define OBJECT_HEADER_WORDS 2
+
+/**
+ * Initialises the reference count words for a newly allocated object, which
+ * is owned by the calling thread.
+ */
+PRIVATE void init_refcount(id obj);
+#else
+#	define OBJECT_HEADER_WORDS 1
+#	define init_refcount(obj) do {} while(0)
+#endif
+
+#endif // __OBJC_REFCOUNT_H_INCLUDED
@@ -360,9 +360,12 @@ id object_copy(id obj, size_t size)
 	return cpy;
 }
 
+PRIVATE void release_monitor_for_object(id obj);
+
 id object_dispose(id obj)
 {
 	call_cxx_destruct(obj);
+	release_monitor_for_object(obj);
 	gc->free_object(obj);
 	return nil;
 }
@@ -23,6 +23,34 @@ static SparseArray EmptyArray24 = { 0xff0000, 24, 0, (void**)&EmptyArrayData24};
 #define base_shift 8
 #define base_mask ((1<<base_shift) - 1)
 
+#ifdef COMPACT_DTABLE
+/**
+ * Number of entries in a new compact leaf.  Compact leaves grow by a factor of
+ * four when they are three-quarters full.  Instead of growing beyond 64
+ * entries, they are replaced by a full leaf.
+ */
+#define COMPACT_LEAF_SIZE 16
+#define IS_COMPACT(sarray) \
+	((0 == sarray->shift) && (base_mask != sarray->mask))
+#define COMPACT_KEYS(sarray) ((uint8_t*)(sarray->data + DATA_SIZE(sarray)))
+#endif
+
+/**
+ * Returns the number of bytes used by the data array of a sparse array node.
+ */
+static size_t data_size(SparseArray *sarray)
+{
+	size_t size = DATA_SIZE(sarray) * sizeof(void*);
+#ifdef COMPACT_DTABLE
+	if (IS_COMPACT(sarray))
+	{
+		// One key byte per entry.
+		size += DATA_SIZE(sarray);
+	}
+#endif
+	return size;
+}
+
 void *EmptyChildForShift(uint32_t shift)
 {
 	switch(shift)
@@ -41,7 +69,7 @@ void *EmptyChildForShift(uint32_t shift)
 
 static void init_pointers(SparseArray * sarray)
 {
-	sarray->data = calloc(DATA_SIZE(sarray), sizeof(void*));
+	sarray->data = calloc(1, data_size(sarray));
 	if(sarray->shift != 0)
 	{
 		void *data = EmptyChildForShift(sarray->shift);
@@ -52,6 +80,122 @@ static void init_pointers(SparseArray * sarray)
 	}
 }
 
+#ifdef COMPACT_DTABLE
+/**
+ * Creates a new leaf with space for the specified number of entries.  This is
+ * a full leaf if the size is 256, or a compact leaf otherwise.
+ */
+static SparseArray *compact_leaf_new(uint32_t size)
+{
+	SparseArray *leaf = calloc(1, sizeof(SparseArray));
+	leaf->refCount = 1;
+	leaf->mask = size - 1;
+	init_pointers(leaf);
+	return leaf;
+}
+
+/**
+ * Stores a value in a compact leaf, which must have space for it.  The key is
+ * written before the value, so concurrent readers never see the value paired
+ * with the wrong key.
+ */
+static void compact_store(SparseArray *sarray, uint8_t key, void *value)
+{
+	uint8_t *keys = COMPACT_KEYS(sarray);
+	for (uint32_t i=0, j=key ; i<=sarray->mask ; i++, j++)
+	{
+		j &= sarray->mask;
+		void *old = sarray->data[j];
+		if (SARRAY_EMPTY == old)
+		{
+			keys[j] = key;
+		}
+		else if (keys[j] != key)
+		{
+			continue;
+		}
+		__atomic_store_n(&sarray->data[j], value, __ATOMIC_RELEASE);
+		return;
+	}
+	UNREACHABLE("Compact sparse array leaf is full");
+}
+
+/**
+ * Returns the number of entries in a compact leaf that are in use, including
+ * ones that contain tombstones.
+ */
+static uint32_t compact_used(SparseArray *sarray)
+{
+	uint32_t used = 0;
+	for (uint32_t i=0 ; i<=sarray->mask ; i++)
+	{
+		if (SARRAY_EMPTY != sarray->data[i])
+		{
+			used++;
+		}
+	}
+	return used;
+}
+
+/**
+ * Returns a copy of a compact leaf, without tombstones, with space for the
+ * specified number of entries.
+ */
+static SparseArray *compact_resize(SparseArray *sarray, uint32_t size)
+{
+	SparseArray *leaf = compact_leaf_new(size);
+	uint8_t *keys = COMPACT_KEYS(sarray);
+	for (uint32_t i=0 ; i<=sarray->mask ; i++)
+	{
+		void *value = sarray->data[i];
+		if ((SARRAY_EMPTY == value) || (SARRAY_TOMBSTONE == value))
+		{
+			continue;
+		}
+		if (IS_COMPACT(leaf))
+		{
+			compact_store(leaf, keys[i], value);
+		}
+		else
+		{
+			leaf->data[keys[i]] = value;
+		}
+	}
+	return leaf;
+}
+
+/**
+ * Inserts a value into a compact leaf.  Returns the leaf that should be stored
+ * in the parent node, which is a new, larger, leaf if this one is too full.
+ */
+static SparseArray *compact_insert(SparseArray *sarray, uint32_t index, void *value)
+{
+	uint8_t key = index & base_mask;
+	if (SARRAY_EMPTY == value)
+	{
+		// Removing a value leaves a tombstone, so that we don't break the
+		// probe sequence for other keys.
+		if (SARRAY_EMPTY != SparseArrayCompactLookup(sarray, key))
+		{
+			compact_store(sarray, key, SARRAY_TOMBSTONE);
+		}
+		return sarray;
+	}
+	uint32_t size = DATA_SIZE(sarray);
+	if ((compact_used(sarray) + 1) * 4 > size * 3)
+	{
+		sarray = compact_resize(sarray, (size >= 64) ? base_mask + 1 : size * 4);
+		if (!IS_COMPACT(sarray))
+		{
+			sarray->data[key] = value;
+			return sarray;
+		}
+	}
+	compact_store(sarray, key, value);
+	return sarray;
+}
+#endif
+
 PRIVATE SparseArray * SparseArrayNewWithDepth(uint32_t depth)
 {
 	SparseArray * sarray = calloc(1, sizeof(SparseArray));
@@ -99,6 +243,34 @@ PRIVATE SparseArray *SparseArrayExpandingArray(SparseArray *sarray, uint32_t new
 
 static void *SparseArrayFind(SparseArray * sarray, uint32_t * index)
 {
+#ifdef COMPACT_DTABLE
+	if (IS_COMPACT(sarray))
+	{
+		// Compact leaves are not sorted, so look for the lowest key that is
+		// not before the index.
+		uint8_t *keys = COMPACT_KEYS(sarray);
+		uint32_t start = (*index) & base_mask;
+		uint32_t next = base_mask + 1;
+		void *found = SARRAY_EMPTY;
+		for (uint32_t i=0 ; i<=sarray->mask ; i++)
+		{
+			void *value = sarray->data[i];
+			if ((SARRAY_EMPTY == value) || (SARRAY_TOMBSTONE == value))
+			{
+				continue;
+			}
+			if ((keys[i] >= start) && (keys[i] < next))
+			{
+				next = keys[i];
+				found = value;
+			}
+		}
+		// If nothing was found, this moves the index on to the next leaf,
+		// as the loop below does for full leaves.
+		*index = ((*index) & ~base_mask) + next;
+		return found;
+	}
+#endif
 	uint32_t j = MASK_INDEX((*index));
 	uint32_t max = MAX_INDEX(sarray);
 	if (sarray->shift == 0)
@@ -156,7 +328,11 @@ PRIVATE void *SparseArrayNext(SparseArray * sarray, uint32_t * idx)
 	return SparseArrayFind(sarray, idx);
 }
 
-PRIVATE void SparseArrayInsert(SparseArray * sarray, uint32_t index, void *value)
+/**
+ * Inserts a value into a sparse array.  The root is the node that owns any
+ * compact leaves that are replaced.
+ */
+static void insert(SparseArray *root, SparseArray *sarray, uint32_t index, void *value)
 {
 	if (sarray->shift > 0)
 	{
@@ -179,6 +355,12 @@ PRIVATE void SparseArrayInsert(SparseArray * sarray, uint32_t index, void *value
 				newsarray->shift = sarray->shift - base_shift;
 			}
 			newsarray->mask = sarray->mask >> base_shift;
+#ifdef COMPACT_DTABLE
+			if (0 == newsarray->shift)
+			{
+				newsarray->mask = COMPACT_LEAF_SIZE - 1;
+			}
+#endif
 			init_pointers(newsarray);
 			sarray->data[i] = newsarray;
 			child = newsarray;
@@ -190,7 +372,20 @@ PRIVATE void SparseArrayInsert(SparseArray * sarray, uint32_t index, void *value
 			SparseArrayDestroy(child);
 			child = sarray->data[i];
 		}
-		SparseArrayInsert(child, index, value);
+#ifdef COMPACT_DTABLE
+		if (IS_COMPACT(child))
+		{
+			SparseArray *newChild = compact_insert(child, index, value);
+			if (newChild != child)
+			{
+				__atomic_store_n(&sarray->data[i], newChild, __ATOMIC_RELEASE);
+				child->retired = root->retired;
+				root->retired = child;
+			}
+			return;
+		}
+#endif
+		insert(root, child, index, value);
 	}
 	else
 	{
@@ -198,14 +393,19 @@ PRIVATE void SparseArrayInsert(SparseArray * sarray, uint32_t index, void *value
 	}
 }
 
+PRIVATE void SparseArrayInsert(SparseArray * sarray, uint32_t index, void *value)
+{
+	insert(sarray, sarray, index, value);
+}
+
 PRIVATE SparseArray *SparseArrayCopy(SparseArray * sarray)
 {
 	SparseArray *copy = calloc(1, sizeof(SparseArray));
 	copy->refCount = 1;
 	copy->shift = sarray->shift;
 	copy->mask = sarray->mask;
-	copy->data = malloc(sizeof(void*) * DATA_SIZE(sarray));
-	memcpy(copy->data, sarray->data, sizeof(void*) * DATA_SIZE(sarray));
+	copy->data = malloc(data_size(sarray));
+	memcpy(copy->data, sarray->data, data_size(sarray));
 	// If the sarray has children, increase their refcounts and link them
 	if (sarray->shift > 0)
 	{
@@ -239,18 +439,37 @@ PRIVATE void SparseArrayDestroy(SparseArray * sarray)
 			SparseArrayDestroy((SparseArray*)sarray->data[i]);
 		}
 	}
+#ifdef COMPACT_DTABLE
+	SparseArray *retired = sarray->retired;
+	while (NULL != retired)
+	{
+		SparseArray *next = retired->retired;
+		free(retired->data);
+		free(retired);
+		retired = next;
+	}
+#endif
 	free(sarray->data);
+#ifdef DTABLE_CACHE
+	free(sarray->cache);
+#endif
 	free(sarray);
 }
 
 PRIVATE int SparseArraySize(SparseArray *sarray)
 {
-	int size = 0;
+	int size = data_size(sarray) + sizeof(SparseArray);
+#ifdef COMPACT_DTABLE
+	for (SparseArray *retired = sarray->retired ; NULL != retired ;
+	     retired = retired->retired)
+	{
+		size += data_size(retired) + sizeof(SparseArray);
+	}
+#endif
 	if (sarray->shift == 0)
 	{
-		return 256*sizeof(void*) + sizeof(SparseArray);
+		return size;
 	}
-	size += 256*sizeof(void*) + sizeof(SparseArray);
 	for(unsigned i=0 ; i<=MAX_INDEX(sarray) ; i++)
 	{
 		SparseArray *child = sarray->data[i];
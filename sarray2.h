@@ -16,6 +16,8 @@
 /**
  * Sparse arrays, used to implement dispatch tables.  Current implementation is
  * quite RAM-intensive and could be optimised.  Maps 32-bit integers to pointers.
+ * When built with COMPACT_DTABLE, leaves other than the root start small and
+ * are replaced by larger ones as they fill up.
  *
  * Note that deletion from the array is not supported.  This allows accesses to
  * be done without locking; the worst that can happen is that the caller gets
@@ -47,6 +49,22 @@ typedef struct
 	 * The data stored in this sparse array node.
 	 */
 	void ** data;
+#ifdef DTABLE_CACHE
+	/**
+	 * Method cache for dispatch tables.  This is only ever set in the root
+	 * node of a dtable and is NULL in all other sparse arrays.  See dtable.h.
+	 */
+	void *cache;
+#endif
+#ifdef COMPACT_DTABLE
+	/**
+	 * Compact leaves that have been replaced by larger ones.  Other threads
+	 * may still be reading these, so they are only freed when the root node is
+	 * destroyed.  Linked through their own retired field.  Only set in root
+	 * nodes.
+	 */
+	void *retired;
+#endif
 } SparseArray;
 
 /**
@@ -56,6 +74,69 @@ typedef struct
 	((index & sarray->mask) >> sarray->shift)
 
 #define SARRAY_EMPTY ((void*)0)
+#ifdef COMPACT_DTABLE
+/**
+ * Value stored in a compact leaf in place of a value that has been removed.
+ */
+#define SARRAY_TOMBSTONE ((void*)1)
+#endif
+
+#ifdef COMPACT_DTABLE
+/**
+ * Looks up a value in a compact leaf.  Compact leaves are small open-addressed
+ * tables, keyed on the low byte of the index.  Their mask is the number of
+ * entries minus one, which distinguishes them from full leaves, where the mask
+ * is always 0xff.  The key for each entry is stored in an array of bytes
+ * immediately after the values.
+ *
+ * Removed entries are replaced by SARRAY_TOMBSTONE, slots are never reused
+ * for a different key, and the key is always written before the value, so
+ * readers do not need to lock.
+ */
+static inline void* SparseArrayCompactLookup(SparseArray *sarray, uint32_t index)
+{
+	uint32_t mask = sarray->mask;
+	uint8_t key = index & 0xff;
+	uint8_t *keys = (uint8_t*)(sarray->data + mask + 1);
+	for (uint32_t i=0, j=key ; i<=mask ; i++, j++)
+	{
+		j &= mask;
+		void *value = __atomic_load_n(&sarray->data[j], __ATOMIC_ACQUIRE);
+		if (SARRAY_EMPTY == value)
+		{
+			return SARRAY_EMPTY;
+		}
+		if (keys[j] == key)
+		{
+			return (SARRAY_TOMBSTONE == value) ? SARRAY_EMPTY : value;
+		}
+	}
+	return SARRAY_EMPTY;
+}
+#endif
+/**
+ * Looks up a value in a leaf node.
+ */
+static inline void* SparseArrayLeafLookup(SparseArray *sarray, uint32_t index)
+{
+#ifdef COMPACT_DTABLE
+	if (sarray->mask != 0xff)
+	{
+		return SparseArrayCompactLookup(sarray, index);
+	}
+#endif
+	return sarray->data[index & 0xff];
+}
+#ifdef DENSE_SELECTOR_INDICES
+/**
+ * Sparse selectors may have indices that are larger than a dtable can hold.
+ * Looking them up must fail, rather than wrapping around to another index.
+ */
+#	define SARRAY_CHECK_INDEX(index, max) \
+	if ((index) > (max)) { return SARRAY_EMPTY; }
+#else
+#	define SARRAY_CHECK_INDEX(index, max)
+#endif
 /**
  * Look up the specified value in the sparse array.  This is used in message
  * dispatch and so has been put in the header to allow compilers to inline it,
@@ -72,21 +153,24 @@ static inline void* SparseArrayLookup(SparseArray * sarray, uint32_t index)
 	{
 		default: UNREACHABLE("broken sarray");
 		case 0:
-			return sarray->data[i & 0xff];
+			SARRAY_CHECK_INDEX(i, 0xff);
+			return SparseArrayLeafLookup(sarray, i);
 		case 8:
-			return 
-				((SparseArray*)sarray->data[(i & 0xff00)>>8])->data[(i & 0xff)];
+			SARRAY_CHECK_INDEX(i, 0xffff);
+			return SparseArrayLeafLookup(
+				((SparseArray*)sarray->data[(i & 0xff00)>>8]), i);
 		case 16:
-			return 
+			SARRAY_CHECK_INDEX(i, 0xffffff);
+			return SparseArrayLeafLookup(
 				((SparseArray*)((SparseArray*)
 					sarray->data[(i & 0xff0000)>>16])->
-						data[(i & 0xff00)>>8])->data[(i & 0xff)];
+						data[(i & 0xff00)>>8]), i);
 		case 24:
-			return 
+			return SparseArrayLeafLookup(
 				((SparseArray*)((SparseArray*)((SparseArray*)
 					sarray->data[(i & 0xff000000)>>24])->
 						data[(i & 0xff0000)>>16])->
-							data[(i & 0xff00)>>8])->data[(i & 0xff)];
+							data[(i & 0xff00)>>8]), i);
 	}
 	/*
 	while(sarray->shift > 0)
@@ -137,8 +221,10 @@ void * SparseArrayNext(SparseArray * sarray, uint32_t * index);
 SparseArray *SparseArrayCopy(SparseArray * sarray);
 
 /**
- * Returns the total memory usage of a sparse array.  
+ * Returns the total memory usage of a sparse array.  Nodes that are shared
+ * with other sparse arrays are included.
  */
 int SparseArraySize(SparseArray *sarray);
 
+
 #endif //_SARRAY_H_INCLUDED_
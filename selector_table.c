@@ -37,6 +37,25 @@
  * array.
  */
 static uint32_t selector_count = 1;
+#ifdef DENSE_SELECTOR_INDICES
+/**
+ * First index for sparse selectors.  Dense selectors have indices below this,
+ * so dtables only need to grow beyond 16 bits when a sparse selector is used
+ * in a method list.
+ */
+#define SPARSE_SELECTOR_BASE 0x10000
+/**
+ * Selectors that are only registered by name, for example with
+ * sel_registerName(), are given dense indices until this many selectors have
+ * been registered.  The remainder of the dense range is kept for selectors
+ * that are used in method lists.
+ */
+#define DENSE_NAME_LIMIT 0x8000
+/**
+ * The next index for a sparse selector.
+ */
+static uint32_t sparse_selector_count = SPARSE_SELECTOR_BASE;
+#endif
 /**
  * Mapping from selector numbers to selector names.
  */
@@ -57,6 +76,13 @@ PRIVATE inline BOOL isSelRegistered(SEL sel)
 	{
 		return YES;
 	}
+#ifdef DENSE_SELECTOR_INDICES
+	if (((uintptr_t)sel->name >= SPARSE_SELECTOR_BASE) &&
+	    ((uintptr_t)sel->name < (uintptr_t)sparse_selector_count))
+	{
+		return YES;
+	}
+#endif
 	return NO;
 }
 
@@ -187,14 +213,10 @@ static int selector_equal(const void *k,
 static inline uint32_t hash_selector(const void *s)
 {
 	SEL sel = (SEL)s;
-	uint32_t hash = 5381;
-	const char *str = sel_getNameNonUnique(sel);
-	uint32_t c;
-	while((c = (uint32_t)*str++))
-	{
-		hash = hash * 33 + c;
-	}
+	uint32_t hash = string_hash(sel_getNameNonUnique(sel));
 #ifdef TYPE_DEPENDENT_DISPATCH
+	const char *str;
+	uint32_t c;
 	// We can't use all of the values in the type encoding for the hash,
 	// because our equality test is a bit more complex than simple string
 	// encoding (for example, * and ^C have to be considered equivalent, since
@@ -216,10 +238,10 @@ static inline uint32_t hash_selector(const void *s)
 }
 
 #define MAP_TABLE_NAME selector
-#define MAP_TABLE_SINGLE_THREAD
 #define MAP_TABLE_COMPARE_FUNCTION selector_identical
 #define MAP_TABLE_HASH_KEY hash_selector
 #define MAP_TABLE_HASH_VALUE hash_selector
+#define MAP_TABLE_CONCURRENT
 #include "hash_table.h"
 /**
  * Table of registered selector.  Maps from selector to selector.
@@ -227,7 +249,8 @@ static inline uint32_t hash_selector(const void *s)
 static selector_table *sel_table;
 
 /**
- * Lock protecting the selector table.
+ * Lock protecting the selector table.  This is only needed for modifying the
+ * table.  Lookups do not acquire it.
  */
 mutex_t selector_table_lock;
 
@@ -238,9 +261,16 @@ PRIVATE void log_selector_memory_usage(void)
 	fprintf(stderr, "%d bytes in selector name list.\n", SparseArraySize(selector_list));
 	fprintf(stderr, "%d bytes in selector names.\n", selector_name_copies);
 	fprintf(stderr, "%d bytes (%d entries) in selector hash table.\n", (int)(sel_table->table_size *
-	        sizeof(struct selector_table_cell_struct)), sel_table->table_size);
+	        sizeof(SEL)), sel_table->table_size);
+	uint32_t count = selector_count;
+#ifdef DENSE_SELECTOR_INDICES
+	fprintf(stderr, "%d dense and %d sparse selectors registered.\n", selector_count,
+	        sparse_selector_count - SPARSE_SELECTOR_BASE);
+	count += sparse_selector_count - SPARSE_SELECTOR_BASE;
+#else
 	fprintf(stderr, "%d selectors registered.\n", selector_count);
-	fprintf(stderr, "%d hash table cells per selector (%.2f%% full)\n", sel_table->table_size / selector_count,  ((float)selector_count) /  sel_table->table_size * 100);
+#endif
+	fprintf(stderr, "%d hash table cells per selector (%.2f%% full)\n", sel_table->table_size / count,  ((float)count) /  sel_table->table_size * 100);
 }
 
 
@@ -265,7 +295,6 @@ PRIVATE void init_selector_tables()
 static SEL selector_lookup(const char *name, const char *types)
 {
 	struct objc_selector sel = {{name}, types};
-	LOCK_FOR_SCOPE(&selector_table_lock);
 	return selector_table_get(sel_table, &sel);
 }
 static inline void add_selector_to_table(SEL aSel, int32_t uid, uint32_t idx)
@@ -277,22 +306,39 @@ static inline void add_selector_to_table(SEL aSel, int32_t uid, uint32_t idx)
 	typeList->next = 0;
 	// Store the name.
 	SparseArrayInsert(selector_list, idx, typeList);
+	// Set the selector's name to the uid.  This must happen before the
+	// selector is visible to lock-free lookups.
+	aSel->name = (const char*)(uintptr_t)uid;
 	// Store the selector.
 	selector_insert(sel_table, aSel);
-	// Set the selector's name to the uid.
-	aSel->name = (const char*)(uintptr_t)uid;
+}
+/**
+ * Returns the index for a new selector.  Dense selectors are ones that are
+ * likely to be used in method lists.  Must be called with the selector table
+ * locked.
+ */
+static inline uintptr_t next_selector_index(BOOL dense)
+{
+#ifdef DENSE_SELECTOR_INDICES
+	uint32_t limit = dense ? SPARSE_SELECTOR_BASE : DENSE_NAME_LIMIT;
+	if (selector_count >= limit)
+	{
+		return sparse_selector_count++;
+	}
+#endif
+	return selector_count++;
 }
 /**
  * Really registers a selector.  Must be called with the selector table locked.
+ * The caller is responsible for resizing the dtables afterwards.
  */
-static inline void register_selector_locked(SEL aSel)
+static inline void register_selector_locked(SEL aSel, BOOL dense)
 {
-	uintptr_t idx = selector_count++;
+	uintptr_t idx = next_selector_index(dense);
 	if (NULL == aSel->types)
 	{
 		DEBUG_LOG("Registering selector %d %s\n", (int)idx, sel_getNameNonUnique(aSel));
 		add_selector_to_table(aSel, idx, idx);
-		objc_resize_dtables(selector_count);
 		return;
 	}
 	SEL untyped = selector_lookup(aSel->name, 0);
@@ -306,7 +352,7 @@ static inline void register_selector_locked(SEL aSel)
 		add_selector_to_table(untyped, idx, idx);
 		// If we are in type dependent dispatch mode, the uid for the typed
 		// and untyped versions will be different
-		idx++; selector_count++;
+		idx = next_selector_index(dense);
 	}
 	else
 	{
@@ -328,7 +374,6 @@ static inline void register_selector_locked(SEL aSel)
 	typeList->value = aSel->types;
 	typeList->next = typeListHead->next;
 	typeListHead->next = typeList;
-	objc_resize_dtables(selector_count);
 }
 /**
  * Registers a selector.  This assumes that the argument is never deallocated.
@@ -346,16 +391,24 @@ PRIVATE SEL objc_register_selector(SEL aSel)
 		aSel->name = registered->name;
 		return registered;
 	}
-	LOCK(&selector_table_lock);
-	register_selector_locked(aSel);
-	UNLOCK(&selector_table_lock);
+	LOCK_FOR_SCOPE(&selector_table_lock);
+	// Another thread may have registered it while we were waiting.
+	registered = selector_lookup(aSel->name, aSel->types);
+	if (NULL != registered && selector_equal(aSel, registered))
+	{
+		aSel->name = registered->name;
+		return registered;
+	}
+	register_selector_locked(aSel, YES);
+	objc_resize_dtables(selector_count);
 	return aSel;
 }
 
 /**
- * Registers a selector by copying the argument.
+ * Registers a selector by copying the argument.  Selectors from method lists
+ * should be registered as dense.
  */
-static SEL objc_register_selector_copy(SEL aSel, BOOL copyArgs)
+static SEL objc_register_selector_copy(SEL aSel, BOOL copyArgs, BOOL dense)
 {
 	// If an identical selector is already registered, return it.
 	SEL copy = selector_lookup(aSel->name, aSel->types);
@@ -394,7 +447,8 @@ static SEL objc_register_selector_copy(SEL aSel, BOOL copyArgs)
 		}
 	}
 	// Try to register the copy as the authoritative version
-	register_selector_locked(copy);
+	register_selector_locked(copy, dense);
+	objc_resize_dtables(selector_count);
 	return copy;
 }
 
@@ -475,14 +529,14 @@ SEL sel_registerName(const char *selName)
 {
 	if (NULL == selName) { return NULL; }
 	struct objc_selector sel = {{selName}, 0};
-	return objc_register_selector_copy(&sel, YES);
+	return objc_register_selector_copy(&sel, YES, NO);
 }
 
 SEL sel_registerTypedName_np(const char *selName, const char *types)
 {
 	if (NULL == selName) { return NULL; }
 	struct objc_selector sel = {{selName}, types};
-	return objc_register_selector_copy(&sel, YES);
+	return objc_register_selector_copy(&sel, YES, NO);
 }
 
 const char *sel_getType_np(SEL aSel)
@@ -562,7 +616,7 @@ PRIVATE void objc_register_selectors_from_list(struct objc_method_list *l)
 	{
 		Method m = &l->methods[i];
 		struct objc_selector sel = { {(const char*)m->selector}, m->types };
-		m->selector = objc_register_selector_copy(&sel, NO);
+		m->selector = objc_register_selector_copy(&sel, NO, YES);
 	}
 }
 /**
@@ -575,14 +629,56 @@ PRIVATE void objc_register_selectors_from_class(Class class)
 		objc_register_selectors_from_list(l);
 	}
 }
+/**
+ * Looks up a selector that may already have been registered.  If it has, then
+ * the argument is updated to refer to the registered version and this returns
+ * YES.
+ */
+static inline BOOL resolve_registered_selector(SEL aSel)
+{
+	if (isSelRegistered(aSel))
+	{
+		return YES;
+	}
+	SEL registered = selector_lookup(aSel->name, aSel->types);
+	if (NULL != registered && selector_equal(aSel, registered))
+	{
+		aSel->name = registered->name;
+		return YES;
+	}
+	return NO;
+}
 PRIVATE void objc_register_selector_array(SEL selectors, unsigned long count)
 {
 	// GCC is broken and always sets the count to 0, so we ignore count until
 	// we can throw stupid and buggy compilers in the bin.
+	//
+	// Most of the selectors in a module are usually already registered, so
+	// resolve those without the lock and count the rest.
+	uint32_t missing = 0;
 	for (unsigned long i=0 ;  (NULL != selectors[i].name) ; i++)
 	{
-		objc_register_selector(&selectors[i]);
+		if (!resolve_registered_selector(&selectors[i]))
+		{
+			missing++;
+		}
 	}
+	if (0 == missing) { return; }
+	// Register the remainder in one go.  Each new typed selector may also
+	// need an untyped version, so make space for both, and resize the dtables
+	// once at the end, rather than once per selector.
+	LOCK_FOR_SCOPE(&selector_table_lock);
+	selector_reserve(sel_table, missing * 2);
+	for (unsigned long i=0 ;  (NULL != selectors[i].name) ; i++)
+	{
+		// Another thread may have registered it since we checked, or it may
+		// be a duplicate of one earlier in this array.
+		if (!resolve_registered_selector(&selectors[i]))
+		{
+			register_selector_locked(&selectors[i], YES);
+		}
+	}
+	objc_resize_dtables(selector_count);
 }
 
 
@@ -6,6 +6,7 @@
 #include "objc/hooks.h"
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 void objc_send_initialize(id object);
 
@@ -63,9 +64,10 @@ Slot_t objc_msg_lookup_internal(id *receiver,
 {
 retry:;
 	Class class = classForObject((*receiver));
-	Slot_t result = objc_dtable_lookup(class->dtable, selector->index);
+	Slot_t result = objc_dtable_lookup_cached(class->dtable, selector->index);
 	if (UNLIKELY(0 == result))
 	{
+		DISPATCH_STAT(SLOW_LOOKUP);
 		dtable_t dtable = dtable_for_class(class);
 		/* Install the dtable if it hasn't already been initialized. */
 		if (dtable == uninstalled_dtable)
@@ -84,6 +86,7 @@ retry:;
 		{
 			if (!isSelRegistered(selector))
 			{
+				DISPATCH_STAT(LAZY_SELECTOR);
 				objc_register_selector(selector);
 				// This should be a tail call, but GCC is stupid and won't let
 				// us tail call an always_inline function.
@@ -91,6 +94,7 @@ retry:;
 			}
 			if ((result = objc_dtable_lookup(dtable, get_untyped_idx(selector))))
 			{
+				DISPATCH_STAT(UNTYPED_FALLBACK);
 				return _objc_selector_type_mismatch(class, selector, result);
 			}
 			id newReceiver = objc_proxy_lookup(*receiver, selector);
@@ -98,11 +102,13 @@ retry:;
 			// again with the new object.
 			if (nil != newReceiver)
 			{
+				DISPATCH_STAT(PROXY_LOOKUP);
 				*receiver = newReceiver;
 				return objc_msg_lookup_sender(receiver, selector, sender);
 			}
 			if (0 == result)
 			{
+				DISPATCH_STAT(FORWARD);
 				result = __objc_msg_forward3(*receiver, selector);
 			}
 		}
@@ -180,6 +186,93 @@ Slot_t objc_msg_lookup_sender(id *receiver, SEL selector, id sender)
 	return objc_plane_lookup(receiver, selector, sender);
 }
 
+/**
+ * Records a slot in a polymorphic inline cache.  If another thread is updating
+ * the cache then we simply don't bother: the next send from this call site
+ * will try again.
+ */
+static void objc_slot_cache_fill(struct objc_slot_cache *cache, Class cls,
+                                 Slot_t slot)
+{
+	unsigned int sequence = cache->sequence;
+	if ((sequence & 1) ||
+	    !__sync_bool_compare_and_swap(&cache->sequence, sequence, sequence+1))
+	{
+		return;
+	}
+	struct objc_slot_cache_entry *entry = NULL;
+	// If there is already an (invalidated) entry for this class, then reuse
+	// it, otherwise replace entries in round-robin order.
+	for (int i=0 ; i<OBJC_SLOT_CACHE_SIZE ; i++)
+	{
+		if (cache->entries[i].cls == cls)
+		{
+			entry = &cache->entries[i];
+			break;
+		}
+	}
+	if (NULL == entry)
+	{
+		unsigned int i = cache->next;
+		entry = &cache->entries[i];
+		if (Nil != entry->cls)
+		{
+			cache->evictions++;
+		}
+		cache->next = (i + 1) % OBJC_SLOT_CACHE_SIZE;
+	}
+	entry->cls = cls;
+	entry->slot = slot;
+	entry->version = slot->version;
+	__sync_synchronize();
+	cache->sequence = sequence + 2;
+}
+
+Slot_t objc_slot_lookup_cached_np(id *receiver, SEL selector, id sender,
+                                  struct objc_slot_cache *cache)
+{
+	id object = *receiver;
+	if (UNLIKELY((nil == object) ||
+	             (cache->evictions >= OBJC_SLOT_CACHE_MEGAMORPHIC)))
+	{
+		return objc_msg_lookup_sender(receiver, selector, sender);
+	}
+	Class class = classForObject(object);
+	// Readers never write to the cache, they just check that the sequence
+	// number is even and hasn't changed while they were reading an entry.
+	unsigned int sequence = __atomic_load_n(&cache->sequence, __ATOMIC_ACQUIRE);
+	if (!(sequence & 1))
+	{
+		for (int i=0 ; i<OBJC_SLOT_CACHE_SIZE ; i++)
+		{
+			struct objc_slot_cache_entry *entry = &cache->entries[i];
+			if (entry->cls == class)
+			{
+				Slot_t slot = entry->slot;
+				int version = entry->version;
+				__atomic_thread_fence(__ATOMIC_ACQUIRE);
+				if ((cache->sequence == sequence) && (slot->version == version))
+				{
+					return slot;
+				}
+				break;
+			}
+		}
+	}
+	Slot_t result = objc_msg_lookup_sender(receiver, selector, sender);
+	// Only cache slots that came from the receiver's installed dtable.  Slots
+	// returned by forwarding hooks, proxy lookups, or the untyped fallback are
+	// not safe to cache and neither is anything found while +initialize is
+	// still running.
+	if ((*receiver == object) &&
+	    classHasInstalledDtable(class) &&
+	    (objc_dtable_lookup(class->dtable, selector->index) == result))
+	{
+		objc_slot_cache_fill(cache, class, result);
+	}
+	return result;
+}
+
 Slot_t objc_slot_lookup_super(struct objc_super *super, SEL selector)
 {
 	id receiver = super->receiver;
@@ -322,11 +415,13 @@ Slot_t objc_get_slot(Class cls, SEL selector)
 		{
 			if (!isSelRegistered(selector))
 			{
+				DISPATCH_STAT(LAZY_SELECTOR);
 				objc_register_selector(selector);
 				return objc_get_slot(cls, selector);
 			}
 			if ((result = objc_dtable_lookup(dtable, get_untyped_idx(selector))))
 			{
+				DISPATCH_STAT(UNTYPED_FALLBACK);
 				return _objc_selector_type_mismatch(cls, selector, result);
 			}
 		}
@@ -357,6 +452,78 @@ IMP class_getMethodImplementation_stret(Class cls, SEL name)
 	return class_getMethodImplementation(cls, name);
 }
 
+#ifdef DISPATCH_STATS
+PRIVATE __thread struct dispatch_stats *dispatch_thread_stats;
+/**
+ * List of the counters for every thread that has ever taken a slow path.
+ */
+static struct dispatch_stats *dispatch_stats_list;
+
+PRIVATE struct dispatch_stats *dispatch_stats_register_thread(void)
+{
+	struct dispatch_stats *stats = calloc(1, sizeof(struct dispatch_stats));
+	struct dispatch_stats *head;
+	do
+	{
+		head = __atomic_load_n(&dispatch_stats_list, __ATOMIC_RELAXED);
+		stats->next = head;
+	} while (!__atomic_compare_exchange_n(&dispatch_stats_list, &head, stats,
+	                                      0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	dispatch_thread_stats = stats;
+	return stats;
+}
+
+BOOL objc_getDispatchStats_np(struct objc_dispatch_stats_np *stats)
+{
+	uint64_t totals[DISPATCH_STAT_COUNT] = { 0 };
+	for (struct dispatch_stats *s=__atomic_load_n(&dispatch_stats_list, __ATOMIC_ACQUIRE) ;
+	     NULL != s ; s=s->next)
+	{
+		for (int i=0 ; i<DISPATCH_STAT_COUNT ; i++)
+		{
+			totals[i] += __atomic_load_n(&s->counters[i], __ATOMIC_RELAXED);
+		}
+	}
+	stats->slow_lookups = totals[DISPATCH_STAT_SLOW_LOOKUP];
+	stats->untyped_fallbacks = totals[DISPATCH_STAT_UNTYPED_FALLBACK];
+	stats->proxy_lookups = totals[DISPATCH_STAT_PROXY_LOOKUP];
+	stats->forwards = totals[DISPATCH_STAT_FORWARD];
+	stats->initialize_waits = totals[DISPATCH_STAT_INITIALIZE_WAIT];
+	stats->lazy_selector_registrations = totals[DISPATCH_STAT_LAZY_SELECTOR];
+	stats->return_values_elided = totals[DISPATCH_STAT_RETURN_ELIDED];
+	stats->return_values_autoreleased = totals[DISPATCH_STAT_RETURN_AUTORELEASED];
+	return YES;
+}
+
+PRIVATE void log_dispatch_stats(void)
+{
+	struct objc_dispatch_stats_np stats;
+	objc_getDispatchStats_np(&stats);
+	fprintf(stderr, "%llu slow message lookups.\n",
+	        (unsigned long long)stats.slow_lookups);
+	fprintf(stderr, "%llu methods found by untyped selector.\n",
+	        (unsigned long long)stats.untyped_fallbacks);
+	fprintf(stderr, "%llu proxy lookups.\n",
+	        (unsigned long long)stats.proxy_lookups);
+	fprintf(stderr, "%llu messages forwarded.\n",
+	        (unsigned long long)stats.forwards);
+	fprintf(stderr, "%llu lookups waited for +initialize.\n",
+	        (unsigned long long)stats.initialize_waits);
+	fprintf(stderr, "%llu selectors registered on first send.\n",
+	        (unsigned long long)stats.lazy_selector_registrations);
+	fprintf(stderr, "%llu return values handed over without autoreleasing.\n",
+	        (unsigned long long)stats.return_values_elided);
+	fprintf(stderr, "%llu return values autoreleased.\n",
+	        (unsigned long long)stats.return_values_autoreleased);
+}
+#else
+BOOL objc_getDispatchStats_np(struct objc_dispatch_stats_np *stats)
+{
+	memset(stats, 0, sizeof(struct objc_dispatch_stats_np));
+	return NO;
+}
+#endif
+
 
 ////////////////////////////////////////////////////////////////////////////////
 // Legacy compatibility
@@ -398,6 +565,7 @@ IMP objc_msg_lookup(id receiver, SEL selector)
 	Slot_t slot = objc_msg_lookup_internal(&self, selector, nil);
 	if (self != receiver)
 	{
+		DISPATCH_STAT(FORWARD);
 		slot = __objc_msg_forward3(receiver, selector);
 	}
 	return slot->method;
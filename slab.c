@@ -0,0 +1,443 @@
+/**
+ * A size-class slab allocator for objects, used by gc_none.c when the runtime
+ * is built with SLAB_ALLOCATOR.
+ *
+ * Address space is reserved from the OS in chunks, which are split into slabs.
+ * Each slab holds blocks of a single size and belongs to one thread, which
+ * allocates from it without any atomic operations.  Blocks that the owning
+ * thread frees go onto its free list for that size class, its magazine, and
+ * are reused first.  Blocks that other threads free are pushed onto a
+ * lock-free list in the owner's state, which the owner takes in one go when
+ * its magazine is empty.
+ *
+ * Blocks that have never been used are handed out straight from the slab,
+ * which the OS provides already zeroed.  Freed blocks are cleared when they
+ * are freed, while they are probably still in the cache, so every block on a
+ * free list is zeroed apart from its link.
+ *
+ * Slabs are never returned to the OS.  When a thread exits, its state,
+ * including its slabs and free lists, is taken over by the next thread that
+ * allocates or frees an object.
+ */
+#include "visibility.h"
+#include "objc/runtime.h"
+#include "slab.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#ifdef SLAB_ALLOCATOR
+#ifdef WIN32
+#	error The slab allocator requires mmap()
+#endif
+#ifndef COMPILER_TLS
+#	error The slab allocator requires COMPILER_TLS
+#endif
+#include <pthread.h>
+#include <sys/mman.h>
+#include "lock.h"
+
+/**
+ * Size of a slab.  Slabs are aligned to their size, so the slab containing a
+ * block can be found by masking its address.
+ */
+#define SLAB_SIZE (64 * 1024)
+/**
+ * Size of the chunks of address space that slabs are carved from.  Chunks are
+ * aligned to their size.
+ */
+#define SLAB_CHUNK_SIZE (16 * SLAB_SIZE)
+/**
+ * Difference in size between adjacent size classes.  Also the alignment of
+ * every block, which matches what calloc() returns.
+ */
+#define SLAB_GRANULE 16
+/**
+ * Largest allocation that is served from a slab.  Larger ones use calloc().
+ */
+#define SLAB_MAX_SIZE 512
+#define SLAB_CLASSES (SLAB_MAX_SIZE / SLAB_GRANULE)
+/**
+ * Number of entries in the table of chunks.  Once this is three quarters
+ * full, no more chunks are reserved and allocations fall back to calloc().
+ */
+#define SLAB_CHUNK_TABLE_SIZE 4096
+
+enum slab_stat
+{
+	/** Blocks allocated from slabs. */
+	SLAB_STAT_ALLOCATIONS,
+	/** Blocks returned to slabs. */
+	SLAB_STAT_FREES,
+	/** Blocks returned to a slab owned by another thread. */
+	SLAB_STAT_REMOTE_FREES,
+	/** Allocations passed on to calloc(). */
+	SLAB_STAT_LARGE_ALLOCATIONS,
+	/** Total size of the blocks allocated from slabs. */
+	SLAB_STAT_BYTES_ALLOCATED,
+	/** Total size of the blocks returned to slabs. */
+	SLAB_STAT_BYTES_FREED,
+	SLAB_STAT_COUNT
+};
+
+/**
+ * A free block.  The link is stored in the first word of the block, and the
+ * rest of the block is zeroed.
+ */
+struct slab_block
+{
+	struct slab_block *next;
+};
+
+/**
+ * A thread's state for one size class.
+ */
+struct slab_magazine
+{
+	/** Blocks freed by the owning thread, ready for reuse. */
+	struct slab_block *free;
+	/** Zeroed, never used space at the end of the current slab. */
+	char *bump;
+	/** The end of the current slab. */
+	char *end;
+};
+
+/**
+ * The allocator state for a thread.  These are never freed, so other threads
+ * can always push blocks onto the remote free lists.
+ */
+struct slab_thread
+{
+	struct slab_magazine magazines[SLAB_CLASSES];
+	/** Counters, written only by the thread using this state. */
+	uint64_t counters[SLAB_STAT_COUNT];
+	/** Non-zero when no thread is using this state. */
+	int exited;
+	struct slab_thread *next;
+	/** Keep the remote free lists off the lines the owner writes. */
+	char padding[64];
+	/**
+	 * Blocks freed by other threads, for each size class.  Other threads push
+	 * blocks with a CAS, and the owner takes the whole list with an exchange,
+	 * so the list is not subject to ABA problems.
+	 */
+	struct slab_block *remoteFree[SLAB_CLASSES];
+};
+
+/**
+ * The header at the start of each slab.
+ */
+struct slab
+{
+	/** The thread state that allocates from this slab.  Never changes. */
+	struct slab_thread *owner;
+	/** The size class of the blocks in this slab. */
+	unsigned int sizeClass;
+};
+
+/** Offset of the first block in a slab. */
+#define SLAB_FIRST_BLOCK \
+	((sizeof(struct slab) + SLAB_GRANULE - 1) & ~(SLAB_GRANULE - 1))
+
+static pthread_once_t slabOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t slabThreadKey;
+static __thread struct slab_thread *slabThread;
+/** Every thread state ever created. */
+static struct slab_thread *slabThreads;
+
+/**
+ * Lock protecting the chunk that slabs are being carved from, and insertions
+ * into the chunk table.
+ */
+static mutex_t slabLock;
+static char *nextSlab;
+static char *chunkEnd;
+static unsigned int slabChunkCount;
+static uint64_t slabBytesMapped;
+/**
+ * Open-addressed set of the addresses of every chunk, used to tell whether a
+ * freed pointer came from a slab.  Entries are only ever added, so lookups do
+ * not need the lock.
+ */
+static uintptr_t slabChunks[SLAB_CHUNK_TABLE_SIZE];
+
+static inline uint32_t chunkHash(uintptr_t chunk)
+{
+	uint32_t hash = (uint32_t)(chunk / SLAB_CHUNK_SIZE) * 2654435761U;
+	return hash >> (32 - __builtin_ctz(SLAB_CHUNK_TABLE_SIZE));
+}
+
+static inline BOOL isSlabChunk(uintptr_t chunk)
+{
+	for (uint32_t i=chunkHash(chunk) ; ; i=(i + 1) & (SLAB_CHUNK_TABLE_SIZE - 1))
+	{
+		uintptr_t entry = __atomic_load_n(&slabChunks[i], __ATOMIC_ACQUIRE);
+		if (entry == chunk) { return YES; }
+		if (0 == entry) { return NO; }
+	}
+}
+
+static void insertSlabChunk(uintptr_t chunk)
+{
+	uint32_t i = chunkHash(chunk);
+	while (0 != slabChunks[i])
+	{
+		i = (i + 1) & (SLAB_CHUNK_TABLE_SIZE - 1);
+	}
+	__atomic_store_n(&slabChunks[i], chunk, __ATOMIC_RELEASE);
+}
+
+static inline void slabStat(struct slab_thread *t, enum slab_stat stat,
+                            uint64_t value)
+{
+	// Only this thread writes the counter, but others may read it.
+	__atomic_store_n(&t->counters[stat], t->counters[stat] + value,
+	                 __ATOMIC_RELAXED);
+}
+
+/**
+ * Marks the state of an exiting thread as free for another thread to take.
+ */
+static void slabThreadExit(void *arg)
+{
+	struct slab_thread *t = arg;
+	slabThread = NULL;
+	__atomic_store_n(&t->exited, 1, __ATOMIC_RELEASE);
+}
+
+static void initSlabAllocator(void)
+{
+	INIT_NONRECURSIVE_LOCK(slabLock);
+	pthread_key_create(&slabThreadKey, slabThreadExit);
+}
+
+static struct slab_thread *registerSlabThread(void)
+{
+	pthread_once(&slabOnce, initSlabAllocator);
+	struct slab_thread *t;
+	// Take over the state of a thread that has exited, along with its slabs,
+	// so that their free space is not lost.
+	for (t=__atomic_load_n(&slabThreads, __ATOMIC_ACQUIRE) ; NULL != t ;
+	     t=t->next)
+	{
+		int exited = 1;
+		if (__atomic_load_n(&t->exited, __ATOMIC_RELAXED) &&
+		    __atomic_compare_exchange_n(&t->exited, &exited, 0, 0,
+		                                __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		{
+			break;
+		}
+	}
+	if (NULL == t)
+	{
+		t = calloc(1, sizeof(struct slab_thread));
+		struct slab_thread *head;
+		do
+		{
+			head = __atomic_load_n(&slabThreads, __ATOMIC_RELAXED);
+			t->next = head;
+		} while (!__atomic_compare_exchange_n(&slabThreads, &head, t, 0,
+		                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+	slabThread = t;
+	pthread_setspecific(slabThreadKey, t);
+	return t;
+}
+
+/**
+ * Returns the address of a new slab, or NULL if no more address space can be
+ * reserved.
+ */
+static struct slab *newSlab(void)
+{
+	LOCK_FOR_SCOPE(&slabLock);
+	if (nextSlab == chunkEnd)
+	{
+		if (slabChunkCount >= SLAB_CHUNK_TABLE_SIZE / 4 * 3)
+		{
+			return NULL;
+		}
+		// Reserve twice the size of a chunk and trim it to an aligned chunk.
+		size_t size = 2 * SLAB_CHUNK_SIZE;
+		char *map = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		                 MAP_PRIVATE | MAP_ANON, -1, 0);
+		if (MAP_FAILED == map)
+		{
+			return NULL;
+		}
+		char *chunk = (char*)(((uintptr_t)map + SLAB_CHUNK_SIZE - 1) &
+		                      ~(uintptr_t)(SLAB_CHUNK_SIZE - 1));
+		char *end = chunk + SLAB_CHUNK_SIZE;
+		if (chunk > map)
+		{
+			munmap(map, chunk - map);
+		}
+		if (map + size > end)
+		{
+			munmap(end, map + size - end);
+		}
+		insertSlabChunk((uintptr_t)chunk);
+		slabChunkCount++;
+		__atomic_store_n(&slabBytesMapped, slabBytesMapped + SLAB_CHUNK_SIZE,
+		                 __ATOMIC_RELAXED);
+		nextSlab = chunk;
+		chunkEnd = end;
+	}
+	struct slab *slab = (struct slab*)nextSlab;
+	nextSlab += SLAB_SIZE;
+	return slab;
+}
+
+/**
+ * Allocates a block when the magazine is empty and the current slab is used
+ * up.  Takes the blocks that other threads have freed if there are any, and
+ * otherwise starts a new slab.
+ */
+static void *slabAllocSlow(struct slab_thread *t, unsigned int sizeClass,
+                           size_t blockSize)
+{
+	struct slab_magazine *m = &t->magazines[sizeClass];
+	struct slab_block *remote =
+		__atomic_exchange_n(&t->remoteFree[sizeClass], NULL, __ATOMIC_ACQUIRE);
+	if (NULL != remote)
+	{
+		m->free = remote->next;
+		remote->next = NULL;
+		return remote;
+	}
+	struct slab *slab = newSlab();
+	if (NULL == slab)
+	{
+		return NULL;
+	}
+	slab->owner = t;
+	slab->sizeClass = sizeClass;
+	m->bump = (char*)slab + SLAB_FIRST_BLOCK + blockSize;
+	m->end = (char*)slab + SLAB_SIZE;
+	return (char*)slab + SLAB_FIRST_BLOCK;
+}
+
+PRIVATE void *slab_alloc(size_t size)
+{
+	struct slab_thread *t = slabThread;
+	if (UNLIKELY(NULL == t))
+	{
+		t = registerSlabThread();
+	}
+	void *block = NULL;
+	unsigned int sizeClass = (size - 1) / SLAB_GRANULE;
+	size_t blockSize = (sizeClass + 1) * SLAB_GRANULE;
+	// Zero-byte allocations wrap around and are passed on to calloc().
+	if ((size - 1) < SLAB_MAX_SIZE)
+	{
+		struct slab_magazine *m = &t->magazines[sizeClass];
+		if (NULL != m->free)
+		{
+			struct slab_block *head = m->free;
+			m->free = head->next;
+			head->next = NULL;
+			block = head;
+		}
+		else if ((size_t)(m->end - m->bump) >= blockSize)
+		{
+			block = m->bump;
+			m->bump += blockSize;
+		}
+		else
+		{
+			block = slabAllocSlow(t, sizeClass, blockSize);
+		}
+	}
+	if (UNLIKELY(NULL == block))
+	{
+		slabStat(t, SLAB_STAT_LARGE_ALLOCATIONS, 1);
+		return calloc(size, 1);
+	}
+	slabStat(t, SLAB_STAT_ALLOCATIONS, 1);
+	slabStat(t, SLAB_STAT_BYTES_ALLOCATED, blockSize);
+	return block;
+}
+
+PRIVATE void slab_free(void *ptr)
+{
+	uintptr_t addr = (uintptr_t)ptr;
+	if (!isSlabChunk(addr & ~(uintptr_t)(SLAB_CHUNK_SIZE - 1)))
+	{
+		free(ptr);
+		return;
+	}
+	struct slab_thread *t = slabThread;
+	if (UNLIKELY(NULL == t))
+	{
+		t = registerSlabThread();
+	}
+	struct slab *slab = (struct slab*)(addr & ~(uintptr_t)(SLAB_SIZE - 1));
+	struct slab_thread *owner = slab->owner;
+	unsigned int sizeClass = slab->sizeClass;
+	size_t blockSize = (sizeClass + 1) * SLAB_GRANULE;
+	struct slab_block *block = ptr;
+	memset(block, 0, blockSize);
+	if (owner == t)
+	{
+		struct slab_magazine *m = &t->magazines[sizeClass];
+		block->next = m->free;
+		m->free = block;
+	}
+	else
+	{
+		struct slab_block **list = &owner->remoteFree[sizeClass];
+		struct slab_block *head = __atomic_load_n(list, __ATOMIC_RELAXED);
+		do
+		{
+			block->next = head;
+		} while (!__atomic_compare_exchange_n(list, &head, block, 0,
+		                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+		slabStat(t, SLAB_STAT_REMOTE_FREES, 1);
+	}
+	slabStat(t, SLAB_STAT_FREES, 1);
+	slabStat(t, SLAB_STAT_BYTES_FREED, blockSize);
+}
+
+BOOL objc_getAllocationStats_np(struct objc_allocation_stats_np *stats)
+{
+	uint64_t totals[SLAB_STAT_COUNT] = { 0 };
+	for (struct slab_thread *t=__atomic_load_n(&slabThreads, __ATOMIC_ACQUIRE) ;
+	     NULL != t ; t=t->next)
+	{
+		for (int i=0 ; i<SLAB_STAT_COUNT ; i++)
+		{
+			totals[i] += __atomic_load_n(&t->counters[i], __ATOMIC_RELAXED);
+		}
+	}
+	stats->slab_allocations = totals[SLAB_STAT_ALLOCATIONS];
+	stats->slab_frees = totals[SLAB_STAT_FREES];
+	stats->remote_frees = totals[SLAB_STAT_REMOTE_FREES];
+	stats->large_allocations = totals[SLAB_STAT_LARGE_ALLOCATIONS];
+	stats->bytes_in_use = totals[SLAB_STAT_BYTES_ALLOCATED] -
+	                      totals[SLAB_STAT_BYTES_FREED];
+	stats->bytes_mapped = __atomic_load_n(&slabBytesMapped, __ATOMIC_RELAXED);
+	return YES;
+}
+
+PRIVATE void log_allocation_stats(void)
+{
+	struct objc_allocation_stats_np stats;
+	objc_getAllocationStats_np(&stats);
+	fprintf(stderr, "%llu objects allocated from slabs.\n",
+	        (unsigned long long)stats.slab_allocations);
+	fprintf(stderr, "%llu objects freed to slabs, %llu by another thread.\n",
+	        (unsigned long long)stats.slab_frees,
+	        (unsigned long long)stats.remote_frees);
+	fprintf(stderr, "%llu objects allocated with calloc().\n",
+	        (unsigned long long)stats.large_allocations);
+	fprintf(stderr, "%llu bytes of objects in %llu bytes of slabs.\n",
+	        (unsigned long long)stats.bytes_in_use,
+	        (unsigned long long)stats.bytes_mapped);
+}
+#else
+BOOL objc_getAllocationStats_np(struct objc_allocation_stats_np *stats)
+{
+	memset(stats, 0, sizeof(struct objc_allocation_stats_np));
+	return NO;
+}
+#endif
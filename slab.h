@@ -0,0 +1,21 @@
+#ifndef __OBJC_SLAB_H_INCLUDED
+#define __OBJC_SLAB_H_INCLUDED
+/**
+ * Size-class slab allocator for objects.  When the runtime is built with
+ * SLAB_ALLOCATOR, gc_none.c allocates objects with these functions instead of
+ * calloc() and free().  See slab.c for the design.
+ */
+#include "visibility.h"
+#include <stddef.h>
+
+/**
+ * Allocates size bytes of zeroed memory.  Small allocations come from a slab
+ * owned by the calling thread, larger ones from calloc().
+ */
+PRIVATE void *slab_alloc(size_t size);
+/**
+ * Frees memory returned by slab_alloc().  May be called from any thread.
+ */
+PRIVATE void slab_free(void *ptr);
+
+#endif // __OBJC_SLAB_H_INCLUDED
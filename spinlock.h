@@ -9,15 +9,60 @@ static unsigned sleep(unsigned seconds)
 #include <unistd.h>
 #endif
 
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
 /**
- * Number of spinlocks.  This allocates one page on 32-bit platforms.
+ * Number of spinlocks.  Each is padded to a cache line, so this allocates
+ * 64KB.
  */
 #define spinlock_count (1<<10)
 static const int spinlock_mask = spinlock_count - 1;
+/**
+ * Size of the cache lines that each spinlock is padded to, so that threads
+ * using different locks do not contend for the same line.
+ */
+#define SPINLOCK_CACHE_LINE 64
+/**
+ * Number of iterations of the pause loop that a thread spends waiting for a
+ * spinlock before it sleeps.
+ */
+#define SPINLOCK_SPIN_LIMIT 1024
+/**
+ * Maximum number of iterations of the pause loop between attempts to acquire
+ * a contended spinlock.
+ */
+#define SPINLOCK_MAX_BACKOFF 64
+
+/**
+ * A spinlock on its own cache line.  The lock word is 0 when unlocked, 1 when
+ * locked, and 2 when locked and threads may be sleeping on it.
+ */
+struct padded_spinlock
+{
+	int lock;
+	/**
+	 * Sequence counter for lock-free readers.  Incremented by writers holding
+	 * the lock before and after they modify the protected value, so it is odd
+	 * while a write is in progress.
+	 */
+	unsigned int sequence;
+	/**
+	 * Numbers of threads reading an object pointer protected by this lock
+	 * without holding it.  Readers increment the counter that the low bit of
+	 * epoch selects.  Writers flip the epoch and wait for the old counter to
+	 * drop to zero before releasing the object that they replaced, so new
+	 * readers can not delay them indefinitely.
+	 */
+	int readers[2];
+	unsigned int epoch;
+} __attribute__((aligned(SPINLOCK_CACHE_LINE)));
 /**
  * Integers used as spinlocks for atomic property access.
  */
-extern int spinlocks[spinlock_count];
+extern struct padded_spinlock spinlocks[spinlock_count];
 /**
  * Get a spin lock from a pointer.  We want to prevent lock contention between
  * properties in the same object - if someone is stupid enough to be using
@@ -26,7 +71,7 @@ extern int spinlocks[spinlock_count];
  * contention between the same property in different objects, so we can't just
  * use the ivar offset.
  */
-static inline volatile int *lock_for_pointer(const void *ptr)
+static inline struct padded_spinlock *spinlock_for_pointer(const void *ptr)
 {
 	intptr_t hash = (intptr_t)ptr;
 	// Most properties will be pointers, so disregard the lowest few bits
@@ -34,21 +79,98 @@ static inline volatile int *lock_for_pointer(const void *ptr)
 	intptr_t low = hash & spinlock_mask;
 	hash >>= 16;
 	hash |= low;
-	return spinlocks + (hash & spinlock_mask);
+	return &spinlocks[hash & spinlock_mask];
+}
+
+static inline volatile int *lock_for_pointer(const void *ptr)
+{
+	return &spinlock_for_pointer(ptr)->lock;
+}
+
+/**
+ * Tells the CPU that we are in a spin-wait loop, so that it can give
+ * resources to the other hyperthread and avoid a pipeline flush on exit.
+ */
+inline static void spinlock_pause(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+/**
+ * Sleeps until the spinlock is woken, if it still has the value of
+ * contended.  Where the platform has no way of sleeping on an address, this
+ * just yields.
+ */
+inline static void spinlock_wait(volatile int *spinlock, int contended)
+{
+#if defined(__linux__)
+	syscall(SYS_futex, spinlock, FUTEX_WAIT_PRIVATE, contended, NULL, NULL, 0);
+#else
+	sleep(0);
+#endif
+}
+
+/**
+ * Wakes one thread sleeping on the spinlock.
+ */
+inline static void spinlock_wake(volatile int *spinlock)
+{
+#if defined(__linux__)
+	syscall(SYS_futex, spinlock, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#endif
 }
 
 /**
- * Unlocks the spinlock.  This is not an atomic operation.  We are only ever
- * modifying the lowest bit of the spinlock word, so it doesn't matter if this
- * is two writes because there is no contention among the high bit.  There is
- * no possibility of contention among calls to this, because it may only be
- * called by the thread owning the spin lock.
+ * Unlocks the spinlock, waking a sleeping thread if there may be one.  This
+ * may only be called by the thread owning the spin lock.
  */
 inline static void unlock_spinlock(volatile int *spinlock)
 {
-	__sync_synchronize();
-	*spinlock = 0;
+	if (2 == __atomic_exchange_n(spinlock, 0, __ATOMIC_RELEASE))
+	{
+		spinlock_wake(spinlock);
+	}
+}
+
+/**
+ * Slow path for acquiring a contended spinlock.  Spins, reading the lock word
+ * and only attempting an atomic operation when it appears to be unlocked, so
+ * that waiting threads share the cache line rather than bouncing it between
+ * them.  The time between attempts grows exponentially.  If the lock is still
+ * held after that, then the owner has probably been descheduled, so we mark
+ * the lock as contended and sleep until it is unlocked.
+ */
+inline static void lock_spinlock_slow(volatile int *spinlock)
+{
+	int backoff = 1;
+	for (int spins=0 ; spins<SPINLOCK_SPIN_LIMIT ; spins+=backoff)
+	{
+		if ((0 == __atomic_load_n(spinlock, __ATOMIC_RELAXED)) &&
+		    __sync_bool_compare_and_swap(spinlock, 0, 1))
+		{
+			return;
+		}
+		for (int i=0 ; i<backoff ; i++)
+		{
+			spinlock_pause();
+		}
+		if (backoff < SPINLOCK_MAX_BACKOFF)
+		{
+			backoff *= 2;
+		}
+	}
+	// We can't tell whether other threads are sleeping, so once we acquire
+	// the lock it stays marked as contended and the unlock will wake one.
+	while (0 != __atomic_exchange_n(spinlock, 2, __ATOMIC_ACQUIRE))
+	{
+		spinlock_wait(spinlock, 2);
+	}
 }
+
 /**
  * Attempts to lock a spinlock.  This is heavily optimised for the uncontended
  * case, because property access should (generally) not be contended.  In the
@@ -57,25 +179,46 @@ inline static void unlock_spinlock(volatile int *spinlock)
  * may require locking a cache line in a cache-coherent SMP system, but it's a
  * lot cheaper than a system call).
  *
- * If the lock is contended, then we just sleep and then try again after the
- * other threads have run.  Note that there is no upper bound on the potential
- * running time of this function, which is one of the great many reasons that
- * using atomic accessors is a terrible idea, but in the common case it should
- * be very fast.
+ * If the lock is contended, then we spin with backoff for a while and then
+ * sleep.  Note that there is no upper bound on the potential running time of
+ * this function, which is one of the great many reasons that using atomic
+ * accessors is a terrible idea, but in the common case it should be very fast.
  */
 inline static void lock_spinlock(volatile int *spinlock)
 {
-	int count = 0;
-	// Set the spin lock value to 1 if it is 0.
-	while(!__sync_bool_compare_and_swap(spinlock, 0, 1))
+	if (!__sync_bool_compare_and_swap(spinlock, 0, 1))
 	{
-		count++;
-		if (0 == count % 10)
-		{
-			// If it is already 1, let another thread play with the CPU for a
-			// bit then try again.
-			sleep(0);
-		}
+		lock_spinlock_slow(spinlock);
 	}
 }
 
+/**
+ * Locks the two spinlocks, in a consistent order so that two threads locking
+ * the same pair can not deadlock.  The locks may be the same.
+ */
+inline static void lock_spinlock_pair(volatile int *lock, volatile int *lock2)
+{
+	if (lock > lock2)
+	{
+		volatile int *tmp = lock;
+		lock = lock2;
+		lock2 = tmp;
+	}
+	lock_spinlock(lock);
+	if (lock2 != lock)
+	{
+		lock_spinlock(lock2);
+	}
+}
+
+/**
+ * Unlocks two spinlocks locked with lock_spinlock_pair().
+ */
+inline static void unlock_spinlock_pair(volatile int *lock, volatile int *lock2)
+{
+	unlock_spinlock(lock);
+	if (lock2 != lock)
+	{
+		unlock_spinlock(lock2);
+	}
+}
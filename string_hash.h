@@ -1,19 +1,73 @@
 #include <string.h>
 #include <stdint.h>
 
+#if defined(__has_feature)
+#	if __has_feature(address_sanitizer)
+#		define STRING_HASH_NO_SANITIZE __attribute__((no_sanitize_address))
+#	endif
+#elif defined(__SANITIZE_ADDRESS__)
+#	define STRING_HASH_NO_SANITIZE __attribute__((no_sanitize_address))
+#endif
+#ifndef STRING_HASH_NO_SANITIZE
+#	define STRING_HASH_NO_SANITIZE
+#endif
+
+/**
+ * Loads the next eight bytes of a string.  This may read past the terminating
+ * nul, but never into the next page, so it can not fault.  Near the end of a
+ * page, the string is copied a byte at a time instead.
+ */
+STRING_HASH_NO_SANITIZE
+static inline uint64_t string_hash_load(const char *str)
+{
+	uint64_t word;
+	if (((uintptr_t)str & 4095) <= (4096 - sizeof(word)))
+	{
+		memcpy(&word, str, sizeof(word));
+	}
+	else
+	{
+		char buffer[sizeof(word)] = { 0 };
+		for (unsigned i=0 ; (i<sizeof(word)) && ('\0' != str[i]) ; i++)
+		{
+			buffer[i] = str[i];
+		}
+		memcpy(&word, buffer, sizeof(word));
+	}
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	word = __builtin_bswap64(word);
+#endif
+	return word;
+}
+
 /**
- * Efficient string hash function.
+ * Efficient string hash function.  This consumes the string a word at a time
+ * and the result does not depend on the string's alignment.
  */
 __attribute__((unused))
 static uint32_t string_hash(const char *str)
 {
-	uint32_t hash = 0;
-	int32_t c;
-	while ((c = *str++))
+	const uint64_t ones = 0x0101010101010101ULL;
+	const uint64_t highs = 0x8080808080808080ULL;
+	uint64_t hash = 0;
+	for (;;)
 	{
-		hash = c + (hash << 6) + (hash << 16) - hash;
+		uint64_t word = string_hash_load(str);
+		// Non-zero if any byte in the word is zero.  The lowest set bit is
+		// always in the first zero byte.
+		uint64_t zero = (word - ones) & ~word & highs;
+		if (0 != zero)
+		{
+			// Discard the terminator and anything after it.
+			unsigned bytes = __builtin_ctzll(zero) / 8;
+			word = (0 == bytes) ? 0 : word & (~0ULL >> (64 - 8 * bytes));
+			hash = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+			return (uint32_t)(hash ^ (hash >> 32));
+		}
+		hash = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+		hash ^= hash >> 32;
+		str += sizeof(word);
 	}
-	return hash;
 }
 
 /**